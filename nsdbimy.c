@@ -31,10 +31,71 @@
 #include "nsdbidrv.h"
 #include <mysql/mysql.h>
 #include <mysql/errmsg.h>
+#include <mysql/mysqld_error.h>
+#ifndef _WIN32
+#include <netinet/tcp.h>
+#endif
 
 
 NS_EXPORT int Ns_ModuleVersion = 1;
 
+struct MyCache;
+
+/*
+ * The following are the values of the compress config option.
+ */
+
+#define MY_COMPRESS_OFF      0
+#define MY_COMPRESS_ON       1
+#define MY_COMPRESS_ADAPTIVE 2
+
+/*
+ * The following are the values of the shardmap config option, and
+ * the number of points each shard has on the hash ring.
+ */
+
+#define MY_SHARD_HASH        0
+#define MY_SHARD_RANGE       1
+#define MY_SHARD_POINTS      64
+
+/*
+ * The following are the formats a query may ask for its whole result
+ * to be returned in, as a single value.
+ */
+
+#define MY_FORMAT_NONE       0
+#define MY_FORMAT_JSON       1
+#define MY_FORMAT_CSV        2
+#define MY_FORMAT_COLUMNS    3   /* Column metadata, not executed. */
+#define MY_STREAM_CHUNK      (64 * 1024)  /* Bytes per streamed write. */
+
+#define MY_JSON_STRING       0   /* Quoted and escaped. */
+#define MY_JSON_NUMBER       1   /* Copied as is... */
+#define MY_JSON_DOCUMENT     2   /* ...as is a JSON column. */
+#define MY_JSON_BINARY       3   /* Base64 string. */
+
+
+/*
+ * The following structure describes one shard of a sharded pool.
+ */
+
+typedef struct MyShard {
+    CONST char   *name;
+    Tcl_WideInt   lower;       /* Range map: lowest key of the shard. */
+    int           numHosts;
+    CONST char  **hosts;       /* Hosts tried in order when connecting. */
+    int          *ports;
+} MyShard;
+
+/*
+ * The following structure is a point on the hash ring.
+ */
+
+typedef struct MyPoint {
+    unsigned int  hash;
+    int           shard;
+} MyPoint;
+
 
 /*
  * The following sructure manages per-pool configuration.
@@ -42,15 +103,116 @@ NS_EXPORT int Ns_ModuleVersion = 1;
 
 typedef struct MyConfig {
     char        *module;
+    CONST char  *server;
+    int          isDefault;
     int          embed;
+    CONST char  *datadir;      /* Embedded server data directory, */
+    CONST char  *bufferPoolSize; /* InnoDB buffer pool, e.g. 256M, */
+    int          tableOpenCache; /* tables kept open, */
+    CONST char  *embedArgs;    /* and any other server options. */
     CONST char  *db;
     CONST char  *user;
     CONST char  *password;
     CONST char  *host;
     int          port;
     CONST char  *unixdomain;
+    int          retries;      /* Default attempts for dbimy retry. */
+    int          retryWait;    /* Base retry backoff in milliseconds. */
+    int          retryMaxWait; /* Upper bound on a single backoff. */
+    struct MyCache *cache;     /* Shared result cache, or NULL. */
+    struct MyWriter *writer;   /* Background write queue, or NULL. */
+
+    int          compress;     /* MY_COMPRESS_OFF, _ON or _ADAPTIVE. */
+    CONST char  *compressAlgorithms;
+    int          zstdLevel;
+    int          compressMinBytes; /* Adaptive: average result size... */
+    int          compressMinRtt;   /* ...and round trip in usec. */
+    Ns_Mutex     lock;             /* Protects the measurements below. */
+    double       avgResultBytes;   /* Moving average of bytes per result. */
+    double       avgRtt;           /* Moving average of ping usec. */
+
+    unsigned int connectTimeout;   /* Seconds, 0 for no limit. */
+    unsigned int readTimeout;
+    unsigned int writeTimeout;
+    int          keepalive;        /* TCP keepalive on... */
+    int          keepIdle;         /* ...after seconds idle, */
+    int          keepInterval;     /* probing every seconds, */
+    int          keepCount;        /* until this many fail. */
+
+    unsigned long connects;        /* Counters, under lock. */
+    unsigned long connectFailures;
+    unsigned long connectTimeouts;
+    unsigned long timeouts;        /* Read or write timeouts. */
+    unsigned long lost;            /* Connections lost. */
+    int          maxQueryStats;    /* Statements to keep stats for. */
+    Tcl_HashTable queryStats;      /* MyQueryStats by SQL, under lock. */
+    unsigned long queryStatsGeneration; /* Incremented by reset. */
+
+    int          admission;        /* Admission control is enabled. */
+    int          maxRunning[2];    /* Concurrent reads, writes; 0 no cap. */
+    int          admitWait;        /* Max ms queued for a slot. */
+    int          latencyTarget;    /* Shed load above this many ms. */
+    Ns_Mutex     admitLock;        /* Protects the admission state below. */
+    Ns_Cond      admitCond[2];     /* Signalled as a read, write ends. */
+    int          running[2];
+    int          waiting[2];
+    double       avgLatency;       /* Moving average of execute usec. */
+    Tcl_WideInt  admitted;
+    Tcl_WideInt  queued;           /* Admitted after waiting... */
+    Tcl_WideInt  waitUsec;         /* ...for so long in total... */
+    Tcl_WideInt  maxWaitUsec;      /* ...and at most. */
+    Tcl_WideInt  admitTimeouts;    /* Gave up waiting. */
+    Tcl_WideInt  shed;             /* Refused as latency was too high. */
+
+    int          numShards;        /* 0 unless a sharded pool. */
+    MyShard     *shards;           /* Sorted by lower for a range map. */
+    int          shardMap;         /* MY_SHARD_HASH or _RANGE. */
+    CONST char  *shardKey;         /* Bind variable to route on... */
+    CONST char  *shardTag;         /* ...marked in the SQL by Bind. */
+    int          numPoints;
+    MyPoint     *ring;             /* Hash map points, sorted by hash. */
+    struct MyScatterPool *scatter; /* Scatter query workers. */
 } MyConfig;
 
+/*
+ * The following structure aggregates the executions of one SQL
+ * statement in a pool, from what the server returns with each.
+ */
+
+typedef struct MyQueryStats {
+    Tcl_WideInt  count;        /* Executions... */
+    Tcl_WideInt  errors;       /* ...and how many failed. */
+    Tcl_WideInt  usec;         /* Elapsed from execute to last row... */
+    Tcl_WideInt  maxUsec;      /* ...and the longest. */
+    Tcl_WideInt  rows;         /* Rows fetched. */
+    Tcl_WideInt  affected;     /* Rows changed by DML. */
+    Tcl_WideInt  insertId;     /* Last auto increment value. */
+    Tcl_WideInt  warnings;
+    Tcl_WideInt  noIndex;      /* Executions which used no index, */
+    Tcl_WideInt  noGoodIndex;  /* no good index, */
+    Tcl_WideInt  slow;         /* or exceeded long_query_time. */
+} MyQueryStats;
+
+
+/*
+ * The following enum classifies MySQL errors so that callers can
+ * decide whether to retry, reconnect or give up.
+ */
+
+typedef enum {
+    MyErrorFatal,            /* Error in the request, don't retry. */
+    MyErrorRetry,            /* Transient conflict: deadlock, lock wait. */
+    MyErrorConnLost          /* Connection to the server is gone. */
+} MyErrorClass;
+
+/*
+ * The following sqlstates are reported for the retryable and lost
+ * connection error classes, whatever the server sent.
+ */
+
+#define MY_SQLSTATE_RETRY    "40001"  /* Serialization failure. */
+#define MY_SQLSTATE_CONNLOST "08S01"  /* Communication link failure. */
+
 
 /*
  * The following structure tracks a single connection to the
@@ -63,6 +225,21 @@ typedef struct MyHandle {
     MYSQL         *conn;     /* Connection to a MySQL database. */
 
     Dbi_Isolation  defaultIsolation;
+    int            lost;     /* Connection lost, don't bother pinging. */
+    int            compressed;  /* Protocol compression enabled. */
+    int            measuring;   /* Counting bytes of the current result. */
+    size_t         resultBytes;
+    Ns_Time        started;     /* Start of last round trip, if timed. */
+
+    MYSQL        **shardConns;  /* Connection per shard, or NULL. */
+    int            shard;       /* Shard of conn. */
+    int            connecting;  /* Connecting to another shard. */
+    int            txShard;     /* Shard of open transaction, or -1. */
+    int            txPending;   /* Begun, waiting for first statement. */
+    Dbi_Isolation  txIsolation;
+    unsigned int   txDepth;     /* Savepoints begun while pending. */
+    int            txOpen;      /* A transaction is open... */
+    unsigned int   txTables;    /* ...which wrote these cache tables. */
 
     MYSQL_BIND     bind[DBI_MAX_BIND];
     unsigned long  lengths[DBI_MAX_BIND];
@@ -70,6 +247,149 @@ typedef struct MyHandle {
 
 } MyHandle;
 
+/*
+ * The following structure describes one column value of a cached
+ * or captured row.
+ */
+
+typedef struct MyCell {
+    size_t         offset;   /* Offset of value in data buffer. */
+    size_t         length;   /* Length of value, 0 for NULL. */
+    int            null;     /* Value is NULL. */
+} MyCell;
+
+/*
+ * The following structure is a complete result set in the cache.
+ * The cells, binary flags, row data and key are allocated with,
+ * and follow, the structure itself.
+ */
+
+typedef struct MyCacheEntry {
+
+    struct MyCacheEntry *prevPtr;   /* LRU list, most recent first. */
+    struct MyCacheEntry *nextPtr;
+    Tcl_HashEntry       *hPtr;      /* NULL once removed from cache. */
+    int                  refCount;  /* Statements replaying this entry. */
+    time_t               expires;
+    unsigned int         tables;    /* Mask of cachetables read. */
+    unsigned int         numCols;
+    unsigned int         numRows;
+    size_t               size;      /* Total size of allocation. */
+
+    MyCell              *cells;     /* numRows * numCols cells. */
+    char                *binary;    /* Binary flag per column. */
+    char                *data;      /* Column values. */
+    char                *key;       /* SQL and bound values. */
+    size_t               keyLength;
+
+} MyCacheEntry;
+
+/*
+ * The following structure manages the result cache of a pool.
+ */
+
+typedef struct MyCache {
+
+    Ns_Mutex       lock;
+    Tcl_HashTable  entries;         /* MyCacheEntry by key hash. */
+    MyCacheEntry  *firstPtr;        /* Most recently used. */
+    MyCacheEntry  *lastPtr;         /* Least recently used. */
+    size_t         size;            /* Current size of all entries. */
+    size_t         maxSize;
+    int            ttl;             /* Seconds an entry is valid. */
+    int            numTables;
+    CONST char   **tables;          /* Tables which invalidate entries. */
+
+    unsigned long  hits;
+    unsigned long  misses;
+    unsigned long  evictions;
+    unsigned long  invalidations;
+    unsigned long  generations[32]; /* Writes to each cache table. */
+
+} MyCache;
+
+/*
+ * The following structure is a row queued for the background writer.
+ * The cells and values follow the structure itself.
+ */
+
+typedef struct MyWriteRow {
+
+    struct MyWriteRow *nextPtr;
+    CONST char        *prefix;      /* Insert ... values, in targets. */
+    unsigned int       numCols;
+    MyCell            *cells;
+    char              *data;
+
+} MyWriteRow;
+
+/*
+ * The following structure manages the background write queue of a
+ * pool and its writer thread.
+ */
+
+typedef struct MyWriter {
+
+    Ns_Mutex       lock;
+    Ns_Cond        cond;            /* Wakes the writer thread. */
+    Ns_Cond        doneCond;        /* Signalled as rows are taken. */
+    Tcl_HashTable  targets;         /* Insert prefixes of queued rows. */
+    MyWriteRow    *firstPtr;        /* Queued rows, oldest first. */
+    MyWriteRow    *lastPtr;
+    int            numQueued;
+    int            numWriting;      /* Rows taken by the writer. */
+    Ns_Time        firstTime;       /* When the oldest row was queued. */
+    int            flushers;        /* Threads waiting for a flush. */
+    int            stop;            /* Server shutting down... */
+    int            stopped;         /* ...and the queue is drained. */
+
+    int            maxQueued;
+    int            batchSize;       /* Rows per insert. */
+    int            flushWait;       /* Max ms a row waits for a batch. */
+    int            enqueueWait;     /* Max ms to wait on a full queue. */
+
+    MYSQL         *conn;            /* Writer thread's own connection. */
+    Tcl_DString    sql;
+    Ns_Thread      thread;
+
+    Tcl_WideInt    enqueued;
+    Tcl_WideInt    dropped;         /* Queue full or shutting down. */
+    Tcl_WideInt    written;
+    Tcl_WideInt    failed;          /* Rows of inserts which failed. */
+    Tcl_WideInt    batches;
+
+} MyWriter;
+
+/*
+ * Largest insert statement the writer builds, well below the default
+ * max_allowed_packet.
+ */
+
+#define MY_WRITE_MAX_BYTES (1024 * 1024)
+
+/*
+ * Default ms dbimy writequeue flush waits for the queue to be written.
+ */
+
+#define MY_WRITE_FLUSH_TIMEOUT 10000
+
+/*
+ * The following structure describes one column of a result set.
+ */
+
+typedef struct MyColumn {
+
+    CONST char    *name;     /* Column name, in meta. */
+    CONST char    *table;    /* Source table, "" for an expression. */
+    int            type;     /* enum enum_field_types. */
+    unsigned int   flags;    /* NOT_NULL_FLAG, UNSIGNED_FLAG etc. */
+    unsigned long  length;   /* Display width. */
+    unsigned int   decimals;
+    unsigned int   charsetnr;   /* 63 is binary. */
+    int            binary;      /* Fetched as MYSQL_TYPE_BLOB. */
+
+} MyColumn;
+
 /*
  * The following structure manages a prepared statement.
  */
@@ -78,9 +398,90 @@ typedef struct MyStatement {
 
     MYSQL_STMT    *st;       /* A MySQL statement. */
     MYSQL_RES     *meta;     /* Result set describing column data. */
+    unsigned int   numCols;  /* Columns in every result set. */
+    MyColumn      *columns;  /* Metadata of each column. */
+
+    int            cacheable;   /* Results may be cached. */
+    unsigned int   tables;      /* Mask of cachetables in the SQL. */
+    Tcl_DString    key;         /* Cache key of current execution. */
+    MyCacheEntry  *entryPtr;    /* Cached result being replayed. */
+    unsigned int   nextRow;     /* Next row of entryPtr. */
+
+    int            fill;        /* Capturing the result for the cache... */
+    unsigned long  generation;  /* ...of tables in this generation. */
+    MyCell        *capCells;    /* Captured cells. */
+    size_t         capRows;     /* Rows captured. */
+    size_t         capAvail;    /* Rows of space in capCells. */
+    Tcl_DString    capData;     /* Captured values. */
+    char           capBinary[DBI_MAX_BIND];
+
+    MyCell        *cells;       /* Cells of current cached row or NULL. */
+    CONST char    *data;        /* Data for cells. */
+    CONST char    *binary;      /* Binary flags for cells. */
+
+    MYSQL_STMT   **shardSts;    /* Statement per shard, or NULL. */
+    int            shardIdx;    /* Value of the shard key, or -1. */
+    int            scatter;     /* Run on every shard... */
+    int            gathered;    /* ...and the rows are in capCells. */
+
+    int            format;      /* MY_FORMAT_*: result is one value... */
+    int            stream;      /* ...or is written to the connection. */
+
+    CONST char    *statsSql;    /* Key of aggregate stats, or NULL... */
+    MyQueryStats  *stats;       /* ...which are found on first use... */
+    unsigned long  statsGeneration; /* ...and again after a reset. */
+    int            timing;      /* Execution not yet recorded... */
+    Ns_Time        started;     /* ...which started at... */
+    Tcl_WideInt    numRows;     /* ...and has fetched so many rows. */
 
 } MyStatement;
 
+/*
+ * The following structure is the part of a scatter query run on
+ * one shard, by a worker or the thread which ran the query.
+ */
+
+typedef struct MyScatter {
+
+    struct MyScatter *nextPtr;  /* Next job waiting for a worker. */
+    int            done;        /* Finished, under the pool lock. */
+
+    CONST char    *shard;       /* Shard name for errors. */
+    MYSQL_STMT    *st;
+    unsigned int   numCols;
+    CONST char    *binary;      /* Binary flag per column. */
+    Dbi_Value     *values;
+    unsigned int   numValues;
+
+    Tcl_DString    cells;       /* MyCell per column per row. */
+    Tcl_DString    data;        /* Column values. */
+    size_t         numRows;
+
+    unsigned int   errnum;      /* Error, if errnum not 0. */
+    char           sqlstate[6];
+    Tcl_DString    error;
+
+} MyScatter;
+
+/*
+ * The following structure manages the worker threads which run the
+ * parts of the scatter queries of a sharded pool.
+ */
+
+typedef struct MyScatterPool {
+
+    Ns_Mutex       lock;
+    Ns_Cond        cond;        /* Wakes the workers. */
+    Ns_Cond        doneCond;    /* Broadcast as jobs and workers end. */
+    MyScatter     *firstPtr;    /* Jobs waiting for a worker. */
+    MyScatter     *lastPtr;
+    int            stop;        /* Server shutting down. */
+    int            numRunning;  /* Workers not yet exited. */
+    int            numThreads;
+    Ns_Thread     *threads;
+
+} MyScatterPool;
+
 
 /*
  * Static functions defined in this file.
@@ -102,8 +503,105 @@ static Dbi_FlushProc        Flush;
 static Dbi_ResetProc        Reset;
 
 static int IsolationLevel(Dbi_Handle *handle, Dbi_Isolation isolation);
+static void TxInvalidate(MyHandle *myHandle);
+static MYSQL *Connect(Dbi_Handle *handle, MyConfig *myCfg, CONST char *host,
+                      int port, CONST char *unixdomain, int *compressedPtr);
+static int Compress(MyConfig *myCfg, MYSQL *conn);
+static void Keepalive(MyConfig *myCfg, MYSQL *conn);
+static int TimedOut(Ns_Time *startPtr, unsigned int timeout);
+static void StartTimer(MyHandle *myHandle);
+static void ConnLost(MyHandle *myHandle);
+static void MeasureResult(MyHandle *myHandle);
+static int BindResult(Dbi_Handle *handle, MyStatement *myStmt);
+static int DrainResults(Dbi_Handle *handle, MyStatement *myStmt);
+static int FetchColumn(Dbi_Handle *handle, MyStatement *myStmt,
+                       unsigned int index, char *value, size_t length);
+static int BindParams(MYSQL_STMT *st, Dbi_Value *values,
+                      unsigned int numValues);
+static int ExecStatement(Dbi_Handle *handle, Dbi_Statement *stmt,
+                         Dbi_Value *values, unsigned int numValues);
+
+static int Serialize(Dbi_Handle *handle, Dbi_Statement *stmt,
+                     MyStatement *myStmt);
+static void JsonString(Tcl_DString *dsPtr, CONST char *value, size_t length);
+static void JsonBase64(Tcl_DString *dsPtr, CONST char *value, size_t length);
+static void CsvField(Tcl_DString *dsPtr, CONST char *value, size_t length);
+static int JsonKind(MyColumn *column);
+static void Describe(MyStatement *myStmt, Tcl_DString *dsPtr);
+static CONST char *TypeName(MyColumn *column);
+static void SetResultValue(MyCache *cache, MyStatement *myStmt,
+                           CONST char *value, int length);
+
+static int ShardsCreate(MyConfig *myCfg, CONST char *server,
+                        CONST char *module, CONST char *path);
+static int ShardOf(MyConfig *myCfg, Dbi_Value *valuePtr,
+                   CONST char **sqlstatePtr, CONST char **msgPtr);
+static MYSQL *ShardConnect(Dbi_Handle *handle, MyHandle *myHandle, int shard);
+static int ShardStatement(Dbi_Handle *handle, Dbi_Statement *stmt,
+                          MyStatement *myStmt, int shard);
+static int Route(Dbi_Handle *handle, Dbi_Statement *stmt, MyStatement *myStmt,
+                 Dbi_Value *values, unsigned int numValues);
+static int Scatter(Dbi_Handle *handle, Dbi_Statement *stmt,
+                   MyStatement *myStmt, Dbi_Value *values,
+                   unsigned int numValues);
+static MyScatterPool *ScatterCreate(MyConfig *myCfg, CONST char *path);
+static Ns_ThreadProc ScatterThread;
+static Ns_ShutdownProc ScatterShutdown;
+static int ScatterTake(MyScatterPool *pool, MyScatter *jobPtr);
+static void ScatterShard(MyScatter *jobPtr);
+static int ScatterFetch(MyScatter *jobPtr);
+static unsigned int Hash32(CONST char *bytes, size_t length);
+static int CompareShards(const void *a, const void *b);
+static int ComparePoints(const void *a, const void *b);
+
+static MyCache *CacheCreate(CONST char *module, CONST char *path);
+static unsigned int CacheTables(MyCache *cache, CONST char *sql);
+static int CacheLookup(MyCache *cache, MyStatement *myStmt,
+                       Dbi_Statement *stmt, Dbi_Value *values,
+                       unsigned int numValues);
+static CONST char *CacheKey(Tcl_DString *dsPtr);
+static int CaptureRow(Dbi_Handle *handle, MyStatement *myStmt);
+static void CacheInsert(MyCache *cache, MyStatement *myStmt);
+static void CacheInvalidate(MyCache *cache, unsigned int tables);
+static unsigned long CacheGeneration(MyCache *cache, unsigned int tables);
+static void CacheRelease(MyCache *cache, MyStatement *myStmt);
+static void CacheRemove(MyCache *cache, MyCacheEntry *entryPtr);
+static int CacheObjCmd(MyConfig *, Tcl_Interp *, int objc, Tcl_Obj *CONST objv[]);
+
+static MyWriter *WriterCreate(MyConfig *myCfg, CONST char *path);
+static Ns_ThreadProc WriterThread;
+static void WriterFlush(MyConfig *myCfg, MyWriter *writer, MyWriteRow *rowPtr);
+static int WriterExec(MyConfig *myCfg, MyWriter *writer);
+static void WriterAppendRow(MyWriter *writer, MyWriteRow *rowPtr);
+static void QuoteName(Tcl_DString *dsPtr, CONST char *name);
+static int CompareColumns(const void *a, const void *b);
+static Ns_ShutdownProc WriterShutdown;
 static void MyException(Dbi_Handle *, MYSQL_STMT *);
-
+static void MyConnException(Dbi_Handle *, MYSQL *);
+static void SetException(Dbi_Handle *handle, unsigned int errnum,
+                         CONST char *sqlstate, CONST char *msg);
+static MyErrorClass ErrorClass(unsigned int errnum);
+
+static void RegisterCommands(CONST char *server);
+static MyConfig *GetConfig(Tcl_Interp *interp, CONST char *pool);
+static Ns_TclTraceProc InitInterp;
+static Tcl_ObjCmdProc MyObjCmd;
+static int RetryObjCmd(MyConfig *, Tcl_Interp *, int objc, Tcl_Obj *CONST objv[]);
+static int IsRetryable(Tcl_Interp *interp);
+static int StatsObjCmd(MyConfig *, Tcl_Interp *, int objc, Tcl_Obj *CONST objv[]);
+static int QueryStatsObjCmd(MyConfig *, Tcl_Interp *, int objc, Tcl_Obj *CONST objv[]);
+static MyQueryStats *QueryStatsGet(MyConfig *myCfg, CONST char *sql);
+static int AdmissionObjCmd(MyConfig *, Tcl_Interp *, int objc, Tcl_Obj *CONST objv[]);
+static int Admit(Dbi_Handle *handle, MyConfig *myCfg, int write,
+                 Ns_Time *startedPtr);
+static void AdmitRelease(MyConfig *myCfg, int write, Ns_Time *startedPtr);
+static void QueryStatsBegin(MyStatement *myStmt);
+static void QueryStatsEnd(MyHandle *myHandle, MyStatement *myStmt, int error);
+static int ShardObjCmd(MyConfig *, Tcl_Interp *, int objc, Tcl_Obj *CONST objv[]);
+static int EnqueueObjCmd(MyConfig *, Tcl_Interp *, int objc, Tcl_Obj *CONST objv[]);
+static int WriteQueueObjCmd(MyConfig *, Tcl_Interp *, int objc, Tcl_Obj *CONST objv[]);
+
+static int LibraryInit(MyConfig *myCfg);
 static void InitThread(void);
 static Ns_TlsCleanup CleanupThread;
 static Ns_Callback AtExit;
@@ -131,8 +629,22 @@ static Dbi_DriverProc procs[] = {
     {0, NULL}
 };
 
+#ifdef DBIMY_SHIM
+/*
+ * Test build linked against tests/shim/fakemysql.c.
+ */
+extern Tcl_ObjCmdProc DbiMyShimObjCmd;
+#endif
+
 static Ns_Tls tls; /* For the thread exit callback. */
 
+static Ns_Mutex  libraryLock;   /* Serialises mysql_library_init. */
+static MyConfig *libraryCfg;    /* Pool which initialised the library. */
+
+static Tcl_HashTable configs; /* MyConfig by pool (module) name. */
+static Tcl_HashTable servers; /* Servers with the dbimy command. */
+static Tcl_HashTable shardKeys; /* Shard key names of all pools. */
+
 
 
 /*
@@ -156,6 +668,9 @@ Ns_ModuleInit(CONST char *server, CONST char *module)
 {
     MyConfig          *myCfg;
     char              *path;
+    CONST char        *mode;
+    Tcl_HashEntry     *hPtr;
+    int                new, i, maxHandles;
     static CONST char *drivername = "dbimy";
     static CONST char *database   = "mysql";
     static int         once = 0;
@@ -169,18 +684,21 @@ Ns_ModuleInit(CONST char *server, CONST char *module)
 
     if (!once) {
         once = 1;
-        if (mysql_library_init(0, NULL, NULL)) {
-            return NS_ERROR;
-        }
+        Ns_MutexSetName2(&libraryLock, "dbimy", "library");
         Ns_TlsAlloc(&tls, CleanupThread);
+        Tcl_InitHashTable(&configs, TCL_STRING_KEYS);
+        Tcl_InitHashTable(&servers, TCL_STRING_KEYS);
+        Tcl_InitHashTable(&shardKeys, TCL_STRING_KEYS);
         Ns_RegisterAtExit(AtExit, NULL);
         Ns_RegisterProcInfo(AtExit, "dbimy:cleanshutdown", NULL);
     }
 
     path = Ns_ConfigGetPath(server, module, NULL);
 
-    myCfg = ns_malloc(sizeof(MyConfig));
+    myCfg = ns_calloc(1, sizeof(MyConfig));
     myCfg->module     = ns_strdup(module);
+    myCfg->server     = server;
+    myCfg->isDefault  = Ns_ConfigBool(path,   "default",    0);
     myCfg->embed      = Ns_ConfigBool(path,   "embed",      0);
     myCfg->db         = Ns_ConfigString(path, "database",   "mysql");
     myCfg->user       = Ns_ConfigString(path, "user",       "root");
@@ -189,6 +707,79 @@ Ns_ModuleInit(CONST char *server, CONST char *module)
     myCfg->port       = Ns_ConfigInt(path,    "port",       0);
     myCfg->unixdomain = Ns_ConfigString(path, "unixdomain", NULL);
 
+    myCfg->retries      = Ns_ConfigIntRange(path, "retries",      3,    1, 100);
+    myCfg->retryWait    = Ns_ConfigIntRange(path, "retrywait",    50,   0, INT_MAX);
+    myCfg->retryMaxWait = Ns_ConfigIntRange(path, "retrymaxwait", 2000, 0, INT_MAX);
+    myCfg->cache        = CacheCreate(module, path);
+
+    mode = Ns_ConfigString(path, "compress", "off");
+    if (STRIEQ(mode, "adaptive")) {
+        myCfg->compress = MY_COMPRESS_ADAPTIVE;
+    } else if (STRIEQ(mode, "on") || STRIEQ(mode, "true")) {
+        myCfg->compress = MY_COMPRESS_ON;
+    } else {
+        myCfg->compress = MY_COMPRESS_OFF;
+    }
+    myCfg->compressAlgorithms =
+        Ns_ConfigString(path, "compressalgorithms", NULL);
+    myCfg->zstdLevel =
+        Ns_ConfigIntRange(path, "zstdlevel", 3, 1, 22);
+    myCfg->compressMinBytes =
+        Ns_ConfigIntRange(path, "compressminbytes", 64 * 1024, 0, INT_MAX);
+    myCfg->compressMinRtt =
+        Ns_ConfigIntRange(path, "compressminrtt", 2000, 0, INT_MAX);
+    myCfg->avgResultBytes = myCfg->avgRtt = 0.0;
+    Ns_MutexInit(&myCfg->lock);
+    Ns_MutexSetName2(&myCfg->lock, "dbimy:config", module);
+
+    myCfg->connectTimeout =
+        Ns_ConfigIntRange(path, "connecttimeout", 10, 0, INT_MAX);
+    myCfg->readTimeout =
+        Ns_ConfigIntRange(path, "readtimeout", 0, 0, INT_MAX);
+    myCfg->writeTimeout =
+        Ns_ConfigIntRange(path, "writetimeout", 0, 0, INT_MAX);
+    myCfg->keepalive    = Ns_ConfigBool(path, "keepalive", 1);
+    myCfg->keepIdle     = Ns_ConfigIntRange(path, "keepidle",  60, 1, INT_MAX);
+    myCfg->keepInterval = Ns_ConfigIntRange(path, "keepintvl", 10, 1, INT_MAX);
+    myCfg->keepCount    = Ns_ConfigIntRange(path, "keepcnt",   6,  1, INT_MAX);
+    myCfg->connects = myCfg->connectFailures = myCfg->connectTimeouts = 0;
+    myCfg->timeouts = myCfg->lost = 0;
+    myCfg->maxQueryStats =
+        Ns_ConfigIntRange(path, "querystats", 1000, 0, INT_MAX);
+    Tcl_InitHashTable(&myCfg->queryStats, TCL_STRING_KEYS);
+
+    myCfg->maxRunning[0] = Ns_ConfigIntRange(path, "maxreads",  0, 0, INT_MAX);
+    myCfg->maxRunning[1] = Ns_ConfigIntRange(path, "maxwrites", 0, 0, INT_MAX);
+    myCfg->admitWait     = Ns_ConfigIntRange(path, "admitwait", 1000, 0, INT_MAX);
+    myCfg->latencyTarget = Ns_ConfigIntRange(path, "latencytarget", 0, 0, INT_MAX);
+    myCfg->admission     = myCfg->maxRunning[0] > 0 || myCfg->maxRunning[1] > 0;
+
+    /*
+     * nsdbi never runs more statements than the pool has handles.
+     */
+
+    maxHandles = Ns_ConfigIntRange(path, "maxhandles", 0, 0, INT_MAX);
+    for (i = 0; i < 2; i++) {
+        if (maxHandles > 0 && myCfg->maxRunning[i] >= maxHandles) {
+            Ns_Log(Warning, "dbimy[%s]: %s %d is not below maxhandles %d "
+                   "and has no effect", module, i ? "maxwrites" : "maxreads",
+                   myCfg->maxRunning[i], maxHandles);
+        }
+    }
+    Ns_MutexInit(&myCfg->admitLock);
+    Ns_MutexSetName2(&myCfg->admitLock, "dbimy:admit", module);
+    Ns_CondInit(&myCfg->admitCond[0]);
+    Ns_CondInit(&myCfg->admitCond[1]);
+    myCfg->running[0] = myCfg->running[1] = 0;
+    myCfg->waiting[0] = myCfg->waiting[1] = 0;
+    myCfg->avgLatency = 0.0;
+    myCfg->admitted = myCfg->queued = myCfg->waitUsec = myCfg->maxWaitUsec = 0;
+    myCfg->admitTimeouts = myCfg->shed = 0;
+
+    if (ShardsCreate(myCfg, server, module, path) != NS_OK) {
+        return NS_ERROR;
+    }
+
     if (*myCfg->db == '\0') {
         Ns_Log(Error, "dbimy[%s]: database '' is invalid", module);
         return NS_ERROR;
@@ -200,9 +791,86 @@ Ns_ModuleInit(CONST char *server, CONST char *module)
         return NS_ERROR;
     }
 
-    return Dbi_RegisterDriver(server, module,
-                              drivername, database,
-                              procs, myCfg);
+    /*
+     * The embedded server is started now, with the options of the
+     * first embedded pool. Other pools initialise the library when
+     * they first connect.
+     */
+
+    myCfg->datadir        = Ns_ConfigString(path, "datadir", NULL);
+    myCfg->bufferPoolSize = Ns_ConfigString(path, "bufferpoolsize", NULL);
+    myCfg->tableOpenCache =
+        Ns_ConfigIntRange(path, "tableopencache", 0, 0, INT_MAX);
+    myCfg->embedArgs      = Ns_ConfigString(path, "embedargs", NULL);
+
+    if (myCfg->embed) {
+        if (LibraryInit(myCfg) != NS_OK) {
+            return NS_ERROR;
+        }
+        if (libraryCfg != myCfg
+                && (myCfg->datadir != NULL || myCfg->bufferPoolSize != NULL
+                    || myCfg->tableOpenCache > 0 || myCfg->embedArgs != NULL)) {
+            Ns_Log(Warning, "dbimy[%s]: embedded server already started "
+                   "by pool %s, server options ignored",
+                   module, libraryCfg->module);
+        }
+    }
+
+    hPtr = Tcl_CreateHashEntry(&configs, module, &new);
+    if (new) {
+        Tcl_SetHashValue(hPtr, myCfg);
+    } else {
+        Ns_Log(Warning, "dbimy[%s]: duplicate pool name, "
+               "dbimy command will use the first", module);
+    }
+    RegisterCommands(server);
+
+    if (Dbi_RegisterDriver(server, module, drivername, database,
+                           procs, myCfg) != NS_OK) {
+        return NS_ERROR;
+    }
+    myCfg->scatter = ScatterCreate(myCfg, path);
+    myCfg->writer  = WriterCreate(myCfg, path);
+
+    return NS_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RegisterCommands --
+ *
+ *      Arrange for the dbimy command to be created in the interps
+ *      of the given server, or of every server for global pools.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Tcl interp trace is registered once per server.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+RegisterCommands(CONST char *server)
+{
+    Ns_Set *set;
+    int     i, new;
+
+    if (server == NULL) {
+        set = Ns_ConfigGetSection("ns/servers");
+        for (i = 0; set != NULL && i < Ns_SetSize(set); i++) {
+            RegisterCommands(Ns_SetKey(set, i));
+        }
+        return;
+    }
+
+    (void) Tcl_CreateHashEntry(&servers, server, &new);
+    if (new) {
+        Ns_TclRegisterTrace(server, InitInterp, NULL, NS_TCL_TRACE_CREATE);
+    }
 }
 
 
@@ -211,7 +879,9 @@ Ns_ModuleInit(CONST char *server, CONST char *module)
  *
  * Open --
  *
- *      Open a connection to the configured mysql database.
+ *      Open a connection to the configured mysql database. A handle
+ *      of a sharded pool connects to the first shard it can reach,
+ *      and to the others as statements are routed to them.
  *
  * Results:
  *      NS_OK or NS_ERROR.
@@ -228,10 +898,105 @@ Open(ClientData configData, Dbi_Handle *handle)
     MyConfig *myCfg = configData;
     MyHandle *myHandle;
     MYSQL    *conn;
-    int       i;
+    Ns_Time   start, end, diff;
+    int       i, compressed = 0;
 
+    if (LibraryInit(myCfg) != NS_OK) {
+        Dbi_SetException(handle, "HY000", "mysql library initialisation failed");
+        return NS_ERROR;
+    }
     InitThread();
 
+    myHandle = ns_calloc(1, sizeof(MyHandle));
+    myHandle->myCfg = myCfg;
+    myHandle->txShard = -1;
+
+    if (myCfg->numShards > 0) {
+        myHandle->shardConns = ns_calloc(myCfg->numShards, sizeof(MYSQL *));
+        conn = NULL;
+        for (i = 0; i < myCfg->numShards && conn == NULL; i++) {
+            if ((conn = ShardConnect(handle, myHandle, i)) == NULL
+                    && i + 1 < myCfg->numShards) {
+                Dbi_LogException(handle, Warning);
+            }
+            myHandle->shard = i;
+        }
+    } else {
+        conn = Connect(handle, myCfg, myCfg->host, myCfg->port,
+                       myCfg->unixdomain, &compressed);
+    }
+    if (conn == NULL) {
+        if (myHandle->shardConns != NULL) {
+            ns_free(myHandle->shardConns);
+        }
+        ns_free(myHandle);
+        return NS_ERROR;
+    }
+
+    myHandle->conn = conn;
+    myHandle->compressed = compressed;
+    handle->driverData = myHandle;
+
+    /*
+     * Measure the round trip to the server for adaptive compression.
+     */
+
+    if (myCfg->compress == MY_COMPRESS_ADAPTIVE) {
+        Ns_GetTime(&start);
+        if (!mysql_ping(conn)) {
+            Ns_GetTime(&end);
+            Ns_DiffTime(&end, &start, &diff);
+            Ns_MutexLock(&myCfg->lock);
+            myCfg->avgRtt = myCfg->avgRtt == 0.0
+                ? diff.sec * 1000000.0 + diff.usec
+                : myCfg->avgRtt * 0.8 + (diff.sec * 1000000.0 + diff.usec) * 0.2;
+            Ns_MutexUnlock(&myCfg->lock);
+        }
+    }
+
+    for (i = 0; i < DBI_MAX_BIND; i++) {
+        myHandle->bind[i].length = myHandle->lengths + i;
+        myHandle->bind[i].is_null = myHandle->nulls + i;
+        myHandle->bind[i].buffer_type = MYSQL_TYPE_STRING;
+    }
+
+    /*
+     * Extra handle info to help with debuging.
+     */
+
+    Dbi_SetException(handle, "00000", "version=%s host=%s compressed=%d",
+                     mysql_get_server_info(conn),
+                     mysql_get_host_info(conn),
+                     compressed);
+
+    return NS_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Connect --
+ *
+ *      Connect to a server and set up the session.
+ *
+ * Results:
+ *      New connection or NULL with exception set, or logged if
+ *      handle is NULL.
+ *
+ * Side effects:
+ *      Connection counters of the pool are updated.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static MYSQL *
+Connect(Dbi_Handle *handle, MyConfig *myCfg, CONST char *host, int port,
+        CONST char *unixdomain, int *compressedPtr)
+{
+    MYSQL   *conn;
+    Ns_Time  start;
+
     conn = mysql_init(NULL);
     if (!conn) {
         Ns_Fatal("dbimy: Open: mysql_init() failed");
@@ -251,82 +1016,111 @@ Open(ClientData configData, Dbi_Handle *handle)
     mysql_options(conn, MYSQL_READ_DEFAULT_GROUP, "dbimy");
 
     /*
-     * Connect and make sure we're in autocomit mode.
+     * Don't let an unreachable or stalled server hold the thread for
+     * the kernel's TCP timeouts. The connect timeout also covers the
+     * handshake.
+     */
+
+    if (myCfg->connectTimeout > 0) {
+        mysql_options(conn, MYSQL_OPT_CONNECT_TIMEOUT, &myCfg->connectTimeout);
+    }
+    if (myCfg->readTimeout > 0) {
+        mysql_options(conn, MYSQL_OPT_READ_TIMEOUT, &myCfg->readTimeout);
+    }
+    if (myCfg->writeTimeout > 0) {
+        mysql_options(conn, MYSQL_OPT_WRITE_TIMEOUT, &myCfg->writeTimeout);
+    }
+
+    *compressedPtr = Compress(myCfg, conn);
+
+    /*
+     * Connect and make sure we're in autocomit mode. Stored procedures
+     * may return more than one result set.
      */
 
-    if (!mysql_real_connect(conn, myCfg->host, myCfg->user, myCfg->password,
-                            myCfg->db, myCfg->port, myCfg->unixdomain, 0)
+    Ns_GetTime(&start);
+
+    if (!mysql_real_connect(conn, host, myCfg->user, myCfg->password,
+                            myCfg->db, port, unixdomain,
+                            CLIENT_MULTI_RESULTS)
         || mysql_autocommit(conn, 1)) {
 
-        Dbi_SetException(handle, mysql_sqlstate(conn), mysql_error(conn));
+        if (handle != NULL) {
+            MyConnException(handle, conn);
+        } else {
+            Ns_Log(Error, "dbimy[%s]: %s", myCfg->module, mysql_error(conn));
+        }
         mysql_close(conn);
-        return NS_ERROR;
-    }
 
-    myHandle = ns_calloc(1, sizeof(MyHandle));
-    myHandle->conn = conn;
-    handle->driverData = myHandle;
+        Ns_MutexLock(&myCfg->lock);
+        myCfg->connectFailures++;
+        if (TimedOut(&start, myCfg->connectTimeout)) {
+            myCfg->connectTimeouts++;
+        }
+        Ns_MutexUnlock(&myCfg->lock);
 
-    for (i = 0; i < DBI_MAX_BIND; i++) {
-        myHandle->bind[i].length = myHandle->lengths + i;
-        myHandle->bind[i].is_null = myHandle->nulls + i;
-        myHandle->bind[i].buffer_type = MYSQL_TYPE_STRING;
+        return NULL;
     }
 
+    Keepalive(myCfg, conn);
+
+    Ns_MutexLock(&myCfg->lock);
+    myCfg->connects++;
+    Ns_MutexUnlock(&myCfg->lock);
+
     /*
      * Make sure the database is expecting and returning utf8 character data.
-     * Refuse to load if this doesn't work.
+     * Refuse to connect if this doesn't work.
      */
 
-    if (Dbi_ExecDirect(handle, "set names 'utf8'") != NS_OK) {
-        Dbi_LogException(handle, Error);
-
-        mysql_close(myHandle->conn);
-        ns_free(myHandle);
-        handle->driverData = NULL;
-
-        return NS_ERROR;
+    if (mysql_query(conn, "set names 'utf8'")) {
+        if (handle != NULL) {
+            MyConnException(handle, conn);
+            Dbi_LogException(handle, Error);
+        } else {
+            Ns_Log(Error, "dbimy[%s]: %s", myCfg->module, mysql_error(conn));
+        }
+        mysql_close(conn);
+        return NULL;
     }
 
     /*
      * Set the default time zone to UTC.
      */
 
-    if (Dbi_ExecDirect(handle, "set session time_zone='+0:00'") != NS_OK) {
-        Dbi_LogException(handle, Error);
+    if (mysql_query(conn, "set session time_zone='+0:00'")) {
+        Ns_Log(Error, "dbimy[%s]: %s", myCfg->module, mysql_error(conn));
     }
-    
 
     /*
      * Enable the 'turn off the bugs' options.
      */
 
-    if (Dbi_ExecDirect(handle, "set session sql_mode='ansi,traditional'")
-            != NS_OK) {
-        Dbi_LogException(handle, Error);
+    if (mysql_query(conn, "set session sql_mode='ansi,traditional'")) {
+        Ns_Log(Error, "dbimy[%s]: %s", myCfg->module, mysql_error(conn));
     }
 
-    /*
-     * Extra handle info to help with debuging.
-     */
-
-    Dbi_SetException(handle, "00000", "version=%s host=%s",
-                     mysql_get_server_info(conn),
-                     mysql_get_host_info(conn));
-
-    return NS_OK;
+    return conn;
 }
 
-
+
 /*
  *----------------------------------------------------------------------
  *
- * Close --
+ * Compress --
  *
- *      Close a database connection.
+ *      Decide whether a new connection should use protocol
+ *      compression and set the connection options.
+ *
+ *      In adaptive mode new handles are compressed only while the
+ *      results the pool returns are large on average and the link
+ *      to the server is slow: compressing small results on a fast
+ *      link costs more CPU than it saves in transfer time. Handles
+ *      are replaced as they hit maxopen or maxqueries and so follow
+ *      changes in the workload.
  *
  * Results:
- *      None.
+ *      1 if compression was enabled, 0 otherwise.
  *
  * Side effects:
  *      None.
@@ -334,14 +1128,211 @@ Open(ClientData configData, Dbi_Handle *handle)
  *----------------------------------------------------------------------
  */
 
-static void
-Close(Dbi_Handle *handle)
+static int
+Compress(MyConfig *myCfg, MYSQL *conn)
 {
-    MyHandle *myHandle = handle->driverData;
-
-    assert(myHandle);
+    int compress;
 
-    mysql_close(myHandle->conn);
+    if (myCfg->embed) {
+        return 0;
+    }
+
+    switch (myCfg->compress) {
+    case MY_COMPRESS_ON:
+        compress = 1;
+        break;
+    case MY_COMPRESS_ADAPTIVE:
+        Ns_MutexLock(&myCfg->lock);
+        compress = myCfg->avgResultBytes >= myCfg->compressMinBytes
+            && myCfg->avgRtt >= myCfg->compressMinRtt;
+        Ns_MutexUnlock(&myCfg->lock);
+        break;
+    default:
+        compress = 0;
+        break;
+    }
+
+    if (compress) {
+#if MYSQL_VERSION_ID >= 80018 && !defined(MARIADB_BASE_VERSION)
+        if (myCfg->compressAlgorithms != NULL) {
+            mysql_options(conn, MYSQL_OPT_COMPRESSION_ALGORITHMS,
+                          myCfg->compressAlgorithms);
+            mysql_options(conn, MYSQL_OPT_ZSTD_COMPRESSION_LEVEL,
+                          &myCfg->zstdLevel);
+        } else {
+            mysql_options(conn, MYSQL_OPT_COMPRESS, NULL);
+        }
+#else
+        mysql_options(conn, MYSQL_OPT_COMPRESS, NULL);
+#endif
+    }
+
+    return compress;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * MeasureResult --
+ *
+ *      Add the size of the last result to the pool's moving average
+ *      used by adaptive compression.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+MeasureResult(MyHandle *myHandle)
+{
+    MyConfig *myCfg = myHandle->myCfg;
+
+    if (myHandle->measuring) {
+        Ns_MutexLock(&myCfg->lock);
+        myCfg->avgResultBytes = myCfg->avgResultBytes * 0.9
+            + myHandle->resultBytes * 0.1;
+        Ns_MutexUnlock(&myCfg->lock);
+        myHandle->measuring = 0;
+        myHandle->resultBytes = 0;
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Keepalive --
+ *
+ *      Turn on TCP keepalive for a new connection so that a server
+ *      which has silently gone away is noticed while the handle is
+ *      idle in the pool, rather than by the next query.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Socket options of TCP connections are set. Unix domain and
+ *      embedded connections are left alone.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+Keepalive(MyConfig *myCfg, MYSQL *conn)
+{
+    struct sockaddr_storage sa;
+    socklen_t               len = sizeof(sa);
+    int                     fd, on = 1;
+
+    if (!myCfg->keepalive || myCfg->embed) {
+        return;
+    }
+
+#if defined(MARIADB_BASE_VERSION) || defined(MARIADB_PACKAGE_VERSION_ID)
+    fd = mysql_get_socket(conn);
+#else
+    fd = conn->net.fd;
+#endif
+
+    if (fd < 0
+            || getsockname(fd, (struct sockaddr *) &sa, &len) != 0
+            || (sa.ss_family != AF_INET && sa.ss_family != AF_INET6)) {
+        return;
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE,
+                   (void *) &on, sizeof(on)) != 0) {
+        Ns_Log(Warning, "dbimy[%s]: SO_KEEPALIVE failed: %s",
+               myCfg->module, strerror(errno));
+        return;
+    }
+#ifdef TCP_KEEPIDLE
+    (void) setsockopt(fd, IPPROTO_TCP, TCP_KEEPIDLE,
+                      (void *) &myCfg->keepIdle, sizeof(int));
+#endif
+#ifdef TCP_KEEPINTVL
+    (void) setsockopt(fd, IPPROTO_TCP, TCP_KEEPINTVL,
+                      (void *) &myCfg->keepInterval, sizeof(int));
+#endif
+#ifdef TCP_KEEPCNT
+    (void) setsockopt(fd, IPPROTO_TCP, TCP_KEEPCNT,
+                      (void *) &myCfg->keepCount, sizeof(int));
+#endif
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TimedOut --
+ *
+ *      Did an operation which started at the given time and failed
+ *      run into a timeout of the given number of seconds? The client
+ *      library gives timeouts no error code of their own.
+ *
+ * Results:
+ *      1 if timed out, 0 otherwise.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+TimedOut(Ns_Time *startPtr, unsigned int timeout)
+{
+    Ns_Time now, diff;
+
+    if (timeout == 0) {
+        return 0;
+    }
+    Ns_GetTime(&now);
+    Ns_DiffTime(&now, startPtr, &diff);
+
+    return diff.sec * 1000 + diff.usec / 1000 >= (long) timeout * 1000 - 100;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Close --
+ *
+ *      Close a database connection.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+Close(Dbi_Handle *handle)
+{
+    MyHandle *myHandle = handle->driverData;
+    int       i;
+
+    assert(myHandle);
+
+    if (myHandle->shardConns != NULL) {
+        for (i = 0; i < myHandle->myCfg->numShards; i++) {
+            if (myHandle->shardConns[i] != NULL) {
+                mysql_close(myHandle->shardConns[i]);
+            }
+        }
+        ns_free(myHandle->shardConns);
+    } else {
+        mysql_close(myHandle->conn);
+    }
     ns_free(myHandle);
 
     handle->driverData = NULL;
@@ -353,7 +1344,9 @@ Close(Dbi_Handle *handle)
  *
  * Connected --
  *
- *      Is the given handle currently connected?
+ *      Is the given handle currently connected? A handle which has
+ *      seen a lost connection error is not pinged again. A half-dead
+ *      connection is caught by the read timeout, if set.
  *
  * Results:
  *      NS_TRUE if connected, NS_FALSE otherwise.
@@ -369,12 +1362,17 @@ Connected(Dbi_Handle *handle)
 {
     MyHandle *myHandle = handle->driverData;
 
-    if (myHandle != NULL
-            && myHandle->conn != NULL
-            && !mysql_ping(myHandle->conn)) {
-        return NS_TRUE;
+    if (myHandle == NULL
+            || myHandle->conn == NULL
+            || myHandle->lost) {
+        return NS_FALSE;
+    }
+    StartTimer(myHandle);
+    if (mysql_ping(myHandle->conn)) {
+        ConnLost(myHandle);
+        return NS_FALSE;
     }
-    return NS_FALSE;
+    return NS_TRUE;
 }
 
 
@@ -386,6 +1384,11 @@ Connected(Dbi_Handle *handle)
  *      Append a bind variable place holder in MySQL syntax to the
  *      given dstring. MySQL uses ? as a place holder.
  *
+ *      The place holder of a shard key is followed by a comment with
+ *      its name and index. The driver isn't told the pool here, so
+ *      this happens for the shard key names of every pool, and
+ *      Prepare looks for the shard key of its own pool.
+ *
  * Results:
  *      Always NS_OK.
  *
@@ -399,6 +1402,11 @@ static void
 Bind(Tcl_DString *ds, CONST char *name, int bindIdx)
 {
     Tcl_DStringAppend(ds, "?", TCL_INDEX_NONE);
+
+    if (shardKeys.numEntries > 0
+            && Tcl_FindHashEntry(&shardKeys, name) != NULL) {
+        Ns_DStringPrintf(ds, " /* dbimy:shard:%s=%d */", name, bindIdx);
+    }
 }
 
 
@@ -427,6 +1435,8 @@ Prepare(Dbi_Handle *handle, Dbi_Statement *stmt,
     MYSQL_STMT    *st;
     MYSQL_RES     *meta;
     MYSQL_FIELD   *field;
+    MyColumn      *columns, *column;
+    CONST char    *p;
     int            i;
 
     InitThread();
@@ -445,10 +1455,12 @@ Prepare(Dbi_Handle *handle, Dbi_Statement *stmt,
         *numColsPtr = mysql_stmt_field_count(st);
 
         /*
-         * Figure out binary/text types for each column.
+         * Keep the metadata of each column, including whether it
+         * is fetched as binary or text.
          */
 
         meta = NULL;
+        columns = NULL;
 
         if (*numColsPtr > 0) {
 
@@ -457,32 +1469,106 @@ Prepare(Dbi_Handle *handle, Dbi_Statement *stmt,
                 (void) mysql_stmt_close(st);
                 return NS_ERROR;
             }
+            columns = ns_calloc(*numColsPtr, sizeof(MyColumn));
 
             for (i = 0; i < *numColsPtr; i++) {
 
                 if ((field = mysql_fetch_field_direct(meta, i)) == NULL) {
-                    MyException(handle, myStmt->st);
+                    MyException(handle, st);
                     (void) mysql_stmt_close(st);
                     mysql_free_result(meta);
+                    ns_free(columns);
                     return NS_ERROR;
                 }
+                column = &columns[i];
+                column->name      = field->name;
+                column->table     = field->org_table != NULL
+                    ? field->org_table : "";
+                column->type      = field->type;
+                column->flags     = field->flags;
+                column->length    = field->length;
+                column->decimals  = field->decimals;
+                column->charsetnr = field->charsetnr;
+
                 switch (field->type) {
                 case MYSQL_TYPE_BLOB:
                 case MYSQL_TYPE_TINY_BLOB:
                 case MYSQL_TYPE_MEDIUM_BLOB:
                 case MYSQL_TYPE_LONG_BLOB:
-                    myHandle->bind[i].buffer_type = MYSQL_TYPE_BLOB;
+                    column->binary = 1;
                     break;
                 default:
-                    myHandle->bind[i].buffer_type = MYSQL_TYPE_STRING;
+                    column->binary = 0;
                 }
             }
         }
 
-        myStmt = ns_malloc(sizeof(MyStatement));
+        myStmt = ns_calloc(1, sizeof(MyStatement));
         myStmt->st = st;
         myStmt->meta = meta;
+        myStmt->numCols = *numColsPtr;
+        myStmt->columns = columns;
+        myStmt->shardIdx = -1;
+        Tcl_DStringInit(&myStmt->key);
+        Tcl_DStringInit(&myStmt->capData);
+
+        /*
+         * Statements of a sharded pool are prepared on each shard as
+         * they are routed to it, by the shard key or to all of them.
+         */
+
+        if (myHandle->shardConns != NULL) {
+            myStmt->shardSts = ns_calloc(myHandle->myCfg->numShards,
+                                         sizeof(MYSQL_STMT *));
+            myStmt->shardSts[myHandle->shard] = st;
+            if ((p = strstr(stmt->sql, myHandle->myCfg->shardTag)) != NULL) {
+                myStmt->shardIdx = atoi(p + strlen(myHandle->myCfg->shardTag));
+            }
+            myStmt->scatter = strstr(stmt->sql, "dbimy:scatter") != NULL;
+        }
+
+        /*
+         * Queries marked dbimy:json or dbimy:csv return their whole
+         * result serialized as one value in one row, or stream it to
+         * the connection with dbimy:json:stream or dbimy:csv:stream.
+         * Those marked dbimy:columns return the column metadata.
+         */
+
+        if (myStmt->numCols > 0 && myStmt->numCols <= DBI_MAX_BIND) {
+            if ((p = strstr(stmt->sql, "dbimy:json")) != NULL) {
+                myStmt->format = MY_FORMAT_JSON;
+                p += 10;
+            } else if ((p = strstr(stmt->sql, "dbimy:csv")) != NULL) {
+                myStmt->format = MY_FORMAT_CSV;
+                p += 9;
+            }
+            myStmt->stream = p != NULL && strncmp(p, ":stream", 7) == 0;
+        }
+        if (strstr(stmt->sql, "dbimy:columns") != NULL) {
+            myStmt->format = MY_FORMAT_COLUMNS;
+        } else if (myHandle->myCfg->maxQueryStats > 0) {
+            myStmt->statsSql = stmt->sql;
+        }
+
+        /*
+         * Queries which ask for it may have their results cached,
+         * and any statement which mentions a cache table may
+         * change it.
+         */
+
+        if (myHandle->myCfg->cache != NULL) {
+            myStmt->tables = CacheTables(myHandle->myCfg->cache, stmt->sql);
+            myStmt->cacheable = myStmt->numCols > 0
+                && myStmt->numCols <= DBI_MAX_BIND
+                && !myStmt->scatter
+                && myStmt->format != MY_FORMAT_COLUMNS
+                && strstr(stmt->sql, "dbimy:cache") != NULL;
+        }
         stmt->driverData = myStmt;
+
+        if (myStmt->format != MY_FORMAT_NONE) {
+            *numColsPtr = 1;
+        }
     }
 
     return NS_OK;
@@ -508,14 +1594,35 @@ Prepare(Dbi_Handle *handle, Dbi_Statement *stmt,
 static void
 PrepareClose(Dbi_Handle *handle, Dbi_Statement *stmt)
 {
-    MyStatement *myStmt = stmt->driverData;
+    MyHandle    *myHandle = handle->driverData;
+    MyStatement *myStmt   = stmt->driverData;
+    int          i;
 
     assert(myStmt);
 
+    CacheRelease(myHandle->myCfg->cache, myStmt);
+    Tcl_DStringFree(&myStmt->key);
+    Tcl_DStringFree(&myStmt->capData);
+    if (myStmt->capCells != NULL) {
+        ns_free(myStmt->capCells);
+    }
+
     if (myStmt->meta != NULL) {
         mysql_free_result(myStmt->meta);
     }
-    mysql_stmt_close(myStmt->st);
+    if (myStmt->columns != NULL) {
+        ns_free(myStmt->columns);
+    }
+    if (myStmt->shardSts != NULL) {
+        for (i = 0; i < myHandle->myCfg->numShards; i++) {
+            if (myStmt->shardSts[i] != NULL) {
+                mysql_stmt_close(myStmt->shardSts[i]);
+            }
+        }
+        ns_free(myStmt->shardSts);
+    } else {
+        mysql_stmt_close(myStmt->st);
+    }
     ns_free(myStmt);
 
     stmt->driverData = NULL;
@@ -533,7 +1640,9 @@ PrepareClose(Dbi_Handle *handle, Dbi_Statement *stmt)
  *      NS_OK or NS_ERROR.
  *
  * Side effects:
- *      ...
+ *      May wait for admission. The result of a dbimy:json or
+ *      dbimy:csv query is fetched and serialized. A dbimy:columns
+ *      query is not executed.
  *
  *----------------------------------------------------------------------
  */
@@ -544,72 +1653,144 @@ Exec(Dbi_Handle *handle, Dbi_Statement *stmt,
 {
     MyHandle    *myHandle = handle->driverData;
     MyStatement *myStmt   = stmt->driverData;
-    MYSQL_BIND   bind[DBI_MAX_BIND];
-    int          i;
+    MyCache     *cache    = myHandle->myCfg->cache;
+    Tcl_DString  ds;
+    Ns_Time      started;
+    int          status;
 
     InitThread();
 
+    if (myStmt->format == MY_FORMAT_COLUMNS) {
+        Tcl_DStringInit(&ds);
+        Describe(myStmt, &ds);
+        SetResultValue(cache, myStmt, ds.string, ds.length);
+        Tcl_DStringFree(&ds);
+        return NS_OK;
+    }
+    if (myStmt->stream && Ns_GetConn() == NULL) {
+        Dbi_SetException(handle, "HY000",
+                         "dbimy: no connection to stream the result to");
+        return NS_ERROR;
+    }
+
     /*
-     * Bind values to parameters.
+     * A cached result is replayed by NextRow without a round trip,
+     * and without waiting for admission. A transaction which wrote
+     * a table reads it from the server: it must see its own writes,
+     * and no one else may see them before the commit.
      */
 
-    if (numValues > 0) {
+    CacheRelease(cache, myStmt);
 
-        memset(bind, 0, sizeof(bind));
+    if (!myStmt->cacheable
+            || (myStmt->tables & myHandle->txTables) != 0
+            || !CacheLookup(cache, myStmt, stmt, values, numValues)) {
 
-        for (i = 0; i < numValues; i++) {
-            if (values[i].data != NULL) {
-                bind[i].buffer_type = values[i].binary
-                    ? MYSQL_TYPE_BLOB
-                    : MYSQL_TYPE_STRING;
-            } else {
-                bind[i].buffer_type = MYSQL_TYPE_NULL;
-            }
-            bind[i].buffer        = (char *) values[i].data;
-            bind[i].buffer_length = values[i].length;
+        if (Admit(handle, myHandle->myCfg, myStmt->numCols == 0,
+                  &started) != NS_OK) {
+            return NS_ERROR;
         }
+        status = ExecStatement(handle, stmt, values, numValues);
+        AdmitRelease(myHandle->myCfg, myStmt->numCols == 0, &started);
 
-        if (mysql_stmt_bind_param(myStmt->st, bind)) {
-            MyException(handle, myStmt->st);
+        if (status != NS_OK) {
+            return NS_ERROR;
+        }
+    }
+    if (myStmt->format != MY_FORMAT_NONE) {
+        return Serialize(handle, stmt, myStmt);
+    }
+
+    return NS_OK;
+}
+
+static int
+ExecStatement(Dbi_Handle *handle, Dbi_Statement *stmt,
+              Dbi_Value *values, unsigned int numValues)
+{
+    MyHandle    *myHandle = handle->driverData;
+    MyStatement *myStmt   = stmt->driverData;
+    MyCache     *cache    = myHandle->myCfg->cache;
+    int          i, status;
+
+    if (myStmt->shardSts != NULL) {
+        if (myStmt->scatter) {
+            return Scatter(handle, stmt, myStmt, values, numValues);
+        }
+        if (Route(handle, stmt, myStmt, values, numValues) != NS_OK) {
             return NS_ERROR;
         }
     }
 
+    if (myHandle->myCfg->compress == MY_COMPRESS_ADAPTIVE) {
+        MeasureResult(myHandle);
+        myHandle->measuring = myStmt->numCols > 0;
+    }
+
+    /*
+     * Bind values to parameters.
+     */
+
+    if (BindParams(myStmt->st, values, numValues)) {
+        MyException(handle, myStmt->st);
+        return NS_ERROR;
+    }
+
     /*
      * Execute the statment and tell mysql where to bind the result data.
+     *
+     * A statement which was prepared without result columns, such
+     * as DML or a CALL, may still return result sets and a final
+     * status packet. Discard them so the connection stays in sync.
      */
 
+    StartTimer(myHandle);
+    QueryStatsBegin(myStmt);
+
     if (mysql_stmt_execute(myStmt->st)) {
+        QueryStatsEnd(myHandle, myStmt, 1);
         MyException(handle, myStmt->st);
         return NS_ERROR;
     }
 
-    if (mysql_stmt_field_count(myStmt->st)) {
-
-        if (!mysql_embedded()) {
-            /* Buffer the entire result set to the client. */
-            mysql_stmt_store_result(myStmt->st);
+    if (myStmt->numCols == 0) {
+        if (myStmt->tables != 0) {
+            CacheInvalidate(cache, myStmt->tables);
+            if (myHandle->txOpen) {
+                myHandle->txTables |= myStmt->tables;
+            }
         }
-
-        if (mysql_stmt_bind_result(myStmt->st, myHandle->bind)) {
-            MyException(handle, myStmt->st);
+        status = DrainResults(handle, myStmt);
+        QueryStatsEnd(myHandle, myStmt, status != NS_OK);
+        return status;
+    }
+    if (mysql_stmt_field_count(myStmt->st)) {
+        if (BindResult(handle, myStmt) != NS_OK) {
+            QueryStatsEnd(myHandle, myStmt, 1);
             return NS_ERROR;
         }
+        if (myStmt->cacheable
+                && (myStmt->tables & myHandle->txTables) == 0) {
+            for (i = 0; i < myStmt->numCols; i++) {
+                myStmt->capBinary[i] = myStmt->columns[i].binary;
+            }
+            myStmt->fill = 1;
+        }
     }
 
     return NS_OK;
 }
 
-
+
 /*
  *----------------------------------------------------------------------
  *
- * NextRow --
+ * BindParams --
  *
- *      Fetch the next row.
+ *      Bind values to the parameters of a statement.
  *
  * Results:
- *      NS_OK or NS_ERROR, endPtr set to 1 after last row has been fetched.
+ *      0 on success, non-zero on error.
  *
  * Side effects:
  *      None.
@@ -618,73 +1799,85 @@ Exec(Dbi_Handle *handle, Dbi_Statement *stmt,
  */
 
 static int
-NextRow(Dbi_Handle *handle, Dbi_Statement *stmt, int *endPtr)
+BindParams(MYSQL_STMT *st, Dbi_Value *values, unsigned int numValues)
 {
-    MyStatement  *myStmt = stmt->driverData;
-    int           status = NS_OK;
-
-    switch (mysql_stmt_fetch(myStmt->st)) {
+    MYSQL_BIND   bind[DBI_MAX_BIND];
+    unsigned int i;
 
-    case MYSQL_NO_DATA:
-        *endPtr = 1;
-        break;
+    if (numValues == 0) {
+        return 0;
+    }
 
-    case 1:
-        MyException(handle, myStmt->st);
-        status = NS_ERROR;
-        break;
+    memset(bind, 0, sizeof(bind));
 
-    case 0:
-    case MYSQL_DATA_TRUNCATED:
-        /* fallthrough */
-        break;
+    for (i = 0; i < numValues; i++) {
+        if (values[i].data != NULL) {
+            bind[i].buffer_type = values[i].binary
+                ? MYSQL_TYPE_BLOB
+                : MYSQL_TYPE_STRING;
+        } else {
+            bind[i].buffer_type = MYSQL_TYPE_NULL;
+        }
+        bind[i].buffer        = (char *) values[i].data;
+        bind[i].buffer_length = values[i].length;
     }
 
-    return status;
+    return mysql_stmt_bind_param(st, bind);
 }
 
-
+
 /*
  *----------------------------------------------------------------------
  *
- * ColumnLength --
+ * BindResult --
  *
- *      Return the length of the column value and it's text/binary
- *      type after a NextRow(). Null values are 0 length.
+ *      Tell mysql where to bind the data of the current result set.
  *
  * Results:
- *      NS_OK;
+ *      NS_OK or NS_ERROR.
  *
  * Side effects:
- *      None.
+ *      Result set is buffered to the client unless embedded.
  *
  *----------------------------------------------------------------------
  */
 
 static int
-ColumnLength(Dbi_Handle *handle, Dbi_Statement *stmt, unsigned int index,
-             size_t *lengthPtr, int *binaryPtr)
+BindResult(Dbi_Handle *handle, MyStatement *myStmt)
 {
-    MyHandle *myHandle = handle->driverData;
+    MyHandle     *myHandle = handle->driverData;
+    unsigned int  i;
 
-    if (myHandle->nulls[index]) {
-        /* MySQL sometimes reports spurious lengths for NULLs... */
-        *lengthPtr = 0;
-    } else {
-        *lengthPtr = (size_t) myHandle->lengths[index];
+    if ((!myHandle->myCfg->embed || !mysql_embedded())
+            && mysql_stmt_store_result(myStmt->st)) {
+        /* Buffer the entire result set to the client. */
+        MyException(handle, myStmt->st);
+        return NS_ERROR;
+    }
+
+    /*
+     * The bind buffers are shared by all statements of the handle.
+     */
+
+    for (i = 0; i < myStmt->numCols; i++) {
+        myHandle->bind[i].buffer_type = myStmt->columns[i].binary
+            ? MYSQL_TYPE_BLOB : MYSQL_TYPE_STRING;
+    }
+    if (mysql_stmt_bind_result(myStmt->st, myHandle->bind)) {
+        MyException(handle, myStmt->st);
+        return NS_ERROR;
     }
-    *binaryPtr = myHandle->bind[index].buffer_type == MYSQL_TYPE_BLOB ? 1 : 0;
 
     return NS_OK;
 }
 
-
+
 /*
  *----------------------------------------------------------------------
  *
- * ColumnValue --
+ * DrainResults --
  *
- *      Fetch the indicated value from the current row.
+ *      Discard the current and all remaining result sets.
  *
  * Results:
  *      NS_OK or NS_ERROR.
@@ -696,21 +1889,196 @@ ColumnLength(Dbi_Handle *handle, Dbi_Statement *stmt, unsigned int index,
  */
 
 static int
-ColumnValue(Dbi_Handle *handle, Dbi_Statement *stmt, unsigned int index,
-            char *value, size_t length)
+DrainResults(Dbi_Handle *handle, MyStatement *myStmt)
 {
-    MyHandle              *myHandle = handle->driverData;
-    MyStatement           *myStmt   = stmt->driverData;
-    MYSQL_BIND             bind;
-    my_bool                error;
-
-    memset(&bind, 0, sizeof(bind));
-    bind.buffer        = value;
-    bind.buffer_length = length;
-    bind.error         = &error;
-    bind.buffer_type   = myHandle->bind[index].buffer_type;
+    int rc;
 
-    error = 0;
+    do {
+        if (mysql_stmt_free_result(myStmt->st)) {
+            MyException(handle, myStmt->st);
+            return NS_ERROR;
+        }
+    } while ((rc = mysql_stmt_next_result(myStmt->st)) == 0);
+
+    if (rc > 0) {
+        MyException(handle, myStmt->st);
+        return NS_ERROR;
+    }
+
+    return NS_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * NextRow --
+ *
+ *      Fetch the next row of the result set.
+ *
+ * Results:
+ *      NS_OK or NS_ERROR, endPtr set to 1 after last row has been fetched.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+NextRow(Dbi_Handle *handle, Dbi_Statement *stmt, int *endPtr)
+{
+    MyHandle     *myHandle = handle->driverData;
+    MyStatement  *myStmt   = stmt->driverData;
+    MyCacheEntry *entryPtr = myStmt->entryPtr;
+    unsigned int  i;
+    int           status   = NS_OK;
+
+    if (entryPtr != NULL) {
+        if (myStmt->nextRow < entryPtr->numRows) {
+            myStmt->cells = entryPtr->cells
+                + (size_t) myStmt->nextRow++ * entryPtr->numCols;
+        } else {
+            *endPtr = 1;
+        }
+        return NS_OK;
+    }
+    if (myStmt->gathered) {
+        if (myStmt->nextRow < myStmt->capRows) {
+            myStmt->cells = myStmt->capCells
+                + (size_t) myStmt->nextRow++ * myStmt->numCols;
+        } else {
+            *endPtr = 1;
+        }
+        return NS_OK;
+    }
+
+    myStmt->cells = NULL;
+
+    switch (mysql_stmt_fetch(myStmt->st)) {
+
+    case MYSQL_NO_DATA:
+        *endPtr = 1;
+        QueryStatsEnd(myHandle, myStmt, 0);
+        if (myStmt->fill) {
+            CacheInsert(myHandle->myCfg->cache, myStmt);
+        }
+        break;
+
+    case 1:
+        QueryStatsEnd(myHandle, myStmt, 1);
+        MyException(handle, myStmt->st);
+        status = NS_ERROR;
+        break;
+
+    case 0:
+    case MYSQL_DATA_TRUNCATED:
+        myStmt->numRows++;
+        if (myHandle->measuring) {
+            for (i = 0; i < myStmt->numCols; i++) {
+                myHandle->resultBytes += myHandle->lengths[i];
+            }
+        }
+        if (myStmt->fill) {
+            status = CaptureRow(handle, myStmt);
+        }
+        break;
+    }
+
+    return status;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ColumnLength --
+ *
+ *      Return the length of the column value and it's text/binary
+ *      type after a NextRow(). Null values are 0 length.
+ *
+ * Results:
+ *      NS_OK;
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ColumnLength(Dbi_Handle *handle, Dbi_Statement *stmt, unsigned int index,
+             size_t *lengthPtr, int *binaryPtr)
+{
+    MyHandle    *myHandle = handle->driverData;
+    MyStatement *myStmt   = stmt->driverData;
+
+    if (myStmt->cells != NULL) {
+        *lengthPtr = myStmt->cells[index].length;
+        *binaryPtr = myStmt->binary[index];
+        return NS_OK;
+    }
+
+    if (myHandle->nulls[index]) {
+        /* MySQL sometimes reports spurious lengths for NULLs... */
+        *lengthPtr = 0;
+    } else {
+        *lengthPtr = (size_t) myHandle->lengths[index];
+    }
+    *binaryPtr = myStmt->columns[index].binary;
+
+    return NS_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ColumnValue --
+ *
+ *      Fetch the indicated value from the current row.
+ *
+ * Results:
+ *      NS_OK or NS_ERROR.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ColumnValue(Dbi_Handle *handle, Dbi_Statement *stmt, unsigned int index,
+            char *value, size_t length)
+{
+    MyStatement *myStmt = stmt->driverData;
+    MyCell      *cell;
+
+    if (myStmt->cells != NULL) {
+        cell = myStmt->cells + index;
+        memcpy(value, myStmt->data + cell->offset,
+               length < cell->length ? length : cell->length);
+        return NS_OK;
+    }
+
+    return FetchColumn(handle, myStmt, index, value, length);
+}
+
+static int
+FetchColumn(Dbi_Handle *handle, MyStatement *myStmt, unsigned int index,
+            char *value, size_t length)
+{
+    MYSQL_BIND             bind;
+    my_bool                error;
+
+    memset(&bind, 0, sizeof(bind));
+    bind.buffer        = value;
+    bind.buffer_length = length;
+    bind.error         = &error;
+    bind.buffer_type   = myStmt->columns[index].binary
+        ? MYSQL_TYPE_BLOB : MYSQL_TYPE_STRING;
+
+    error = 0;
 
     if (mysql_stmt_fetch_column(myStmt->st, &bind, index, 0)) {
         MyException(handle, myStmt->st);
@@ -720,7 +2088,7 @@ ColumnValue(Dbi_Handle *handle, Dbi_Statement *stmt, unsigned int index,
     return NS_OK;
 }
 
-
+
 /*
  *----------------------------------------------------------------------
  *
@@ -742,12 +2110,17 @@ ColumnName(Dbi_Handle *handle, Dbi_Statement *stmt, unsigned int index,
            CONST char **columnPtr)
 {
     MyStatement *myStmt = stmt->driverData;
-    MYSQL_FIELD *field;
 
-    field = mysql_fetch_field_direct(myStmt->meta, index);
-    if (field == NULL) {
-        MyException(handle, myStmt->st);
-        return NS_ERROR;
+    switch (myStmt->format) {
+    case MY_FORMAT_JSON:
+        *columnPtr = "json";
+        return NS_OK;
+    case MY_FORMAT_CSV:
+        *columnPtr = "csv";
+        return NS_OK;
+    case MY_FORMAT_COLUMNS:
+        *columnPtr = "columns";
+        return NS_OK;
     }
 
     /*
@@ -756,7 +2129,7 @@ ColumnName(Dbi_Handle *handle, Dbi_Statement *stmt, unsigned int index,
      *     to it here.
      */
 
-    *columnPtr = field->name;
+    *columnPtr = myStmt->columns[index].name;
 
     return NS_OK;
 }
@@ -784,15 +2157,47 @@ Transaction(Dbi_Handle *handle, unsigned int depth,
 {
     MyHandle   *myHandle = handle->driverData;
     Tcl_DString ds;
+    my_bool     rc;
+
+    /*
+     * The shard of a transaction in a sharded pool is chosen by its
+     * first statement. Until then, only note what was asked for.
+     */
+
+    if (myHandle->shardConns != NULL && myHandle->txShard < 0) {
+        switch (cmd) {
+        case Dbi_TransactionBegin:
+            if (depth == 0) {
+                myHandle->txPending = 1;
+                myHandle->txIsolation = isolation;
+            }
+            myHandle->txDepth = depth;
+            break;
+        case Dbi_TransactionCommit:
+            myHandle->txPending = 0;
+            break;
+        case Dbi_TransactionRollback:
+            if (depth == 0) {
+                myHandle->txPending = 0;
+            } else {
+                myHandle->txDepth = depth - 1;
+            }
+            break;
+        }
+        return NS_OK;
+    }
+
+    StartTimer(myHandle);
 
     switch (cmd) {
 
     case Dbi_TransactionBegin:
         if (depth == 0) {
+            myHandle->txOpen = 1;
+            myHandle->txTables = 0;
             if (IsolationLevel(handle, isolation) != NS_OK
                     || mysql_query(myHandle->conn, "start transaction")) {
-                Dbi_SetException(handle, mysql_sqlstate(myHandle->conn),
-                                 mysql_error(myHandle->conn));
+                MyConnException(handle, myHandle->conn);
                 return NS_ERROR;
             }
         } else {
@@ -800,8 +2205,7 @@ Transaction(Dbi_Handle *handle, unsigned int depth,
             Ns_DStringPrintf(&ds, "savepoint s%u", depth);
 
             if (mysql_query(myHandle->conn, ds.string)) {
-                Dbi_SetException(handle, mysql_sqlstate(myHandle->conn),
-                                 mysql_error(myHandle->conn));
+                MyConnException(handle, myHandle->conn);
                 Tcl_DStringFree(&ds);
                 return NS_ERROR;
             }
@@ -810,28 +2214,29 @@ Transaction(Dbi_Handle *handle, unsigned int depth,
         break;
 
     case Dbi_TransactionCommit:
-        if (mysql_commit(myHandle->conn)
-                || IsolationLevel(handle, isolation) != NS_OK) {
-            Dbi_SetException(handle, mysql_sqlstate(myHandle->conn),
-                             mysql_error(myHandle->conn));
+        myHandle->txShard = -1;
+        rc = mysql_commit(myHandle->conn);
+        TxInvalidate(myHandle);
+        if (rc || IsolationLevel(handle, isolation) != NS_OK) {
+            MyConnException(handle, myHandle->conn);
             return NS_ERROR;
         }
         break;
 
     case Dbi_TransactionRollback:
         if (depth == 0) {
-            if (mysql_rollback(myHandle->conn)
-                    || IsolationLevel(handle, isolation)) {
-                Dbi_SetException(handle, mysql_sqlstate(myHandle->conn),
-                                 mysql_error(myHandle->conn));
+            myHandle->txShard = -1;
+            rc = mysql_rollback(myHandle->conn);
+            TxInvalidate(myHandle);
+            if (rc || IsolationLevel(handle, isolation)) {
+                MyConnException(handle, myHandle->conn);
                 return NS_ERROR;
             }
         } else {
             Tcl_DStringInit(&ds);
             Ns_DStringPrintf(&ds, "rollback to savepoint s%u", depth);
             if (mysql_query(myHandle->conn, ds.string)) {
-                Dbi_SetException(handle, mysql_sqlstate(myHandle->conn),
-                                 mysql_error(myHandle->conn));
+                MyConnException(handle, myHandle->conn);
                 Tcl_DStringFree(&ds);
                 return NS_ERROR;
             }
@@ -843,6 +2248,37 @@ Transaction(Dbi_Handle *handle, unsigned int depth,
     return NS_OK;
 }
 
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TxInvalidate --
+ *
+ *      Invalidate the cached results of the tables written during the
+ *      transaction which just ended. They were invalidated as each
+ *      write ran, but other threads may since have cached what they
+ *      read before the transaction ended.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Bumps the cache generation of each table written. The
+ *      handle is no longer in a transaction.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+TxInvalidate(MyHandle *myHandle)
+{
+    if (myHandle->txTables != 0) {
+        CacheInvalidate(myHandle->myCfg->cache, myHandle->txTables);
+        myHandle->txTables = 0;
+    }
+    myHandle->txOpen = 0;
+}
+
 static int
 IsolationLevel(Dbi_Handle *handle, Dbi_Isolation isolation)
 {
@@ -868,7 +2304,8 @@ IsolationLevel(Dbi_Handle *handle, Dbi_Isolation isolation)
  *
  * Flush --
  *
- *      Clear the current result, which discards any pending rows.
+ *      Clear the current result, which discards any pending rows,
+ *      and any result sets which have not yet been read.
  *
  * Results:
  *      NS_OK or NS_ERROR.
@@ -882,17 +2319,27 @@ IsolationLevel(Dbi_Handle *handle, Dbi_Isolation isolation)
 static int
 Flush(Dbi_Handle *handle, Dbi_Statement *stmt)
 {
-    MyStatement *myStmt = stmt->driverData;
+    MyHandle    *myHandle = handle->driverData;
+    MyStatement *myStmt   = stmt->driverData;
 
-    if (myStmt->st && mysql_stmt_free_result(myStmt->st)) {
-        MyException(handle, myStmt->st);
+    if (myStmt->entryPtr != NULL || myStmt->gathered) {
+        CacheRelease(myHandle->myCfg->cache, myStmt);
+        return NS_OK;
+    }
+    CacheRelease(myHandle->myCfg->cache, myStmt);
+    MeasureResult(myHandle);
+    StartTimer(myHandle);
+
+    if (myStmt->st && DrainResults(handle, myStmt) != NS_OK) {
+        QueryStatsEnd(myHandle, myStmt, 1);
         return NS_ERROR;
     }
+    QueryStatsEnd(myHandle, myStmt, 0);
 
     return NS_OK;
 }
 
-
+
 /*
  *----------------------------------------------------------------------
  *
@@ -919,75 +2366,2610 @@ Reset(Dbi_Handle *handle)
 /*
  *----------------------------------------------------------------------
  *
- * MyException --
+ * ShardsCreate --
  *
- *      Report a MySQL exception to the dbi layer.
+ *      Read the shard map of a sharded pool: the shardkey and
+ *      shardmap parameters and the shards section, which maps each
+ *      shard to a list of host:port to try in order. For a range
+ *      map the shard names are the lowest key of each range.
  *
  * Results:
- *      None.
+ *      NS_OK, or NS_ERROR if the shard map is invalid.
  *
  * Side effects:
- *      Fatal exit if memory exhausted.
+ *      Shard key name is registered for Bind.
  *
  *----------------------------------------------------------------------
  */
 
-static void
-MyException(Dbi_Handle *handle, MYSQL_STMT *st)
+static int
+ShardsCreate(MyConfig *myCfg, CONST char *server, CONST char *module,
+             CONST char *path)
 {
-    if (mysql_stmt_errno(st) == CR_OUT_OF_MEMORY) {
-        Ns_Fatal("dbimy[%s]: CR_OUT_OF_MEMORY: %s",
-                 Dbi_PoolName(handle->pool), mysql_stmt_error(st));
+    Ns_Set      *set;
+    MyShard     *shardPtr;
+    CONST char  *map;
+    char        *host, *end;
+    int          i, j, new;
+    Tcl_DString  ds;
+
+    myCfg->shardKey = Ns_ConfigString(path, "shardkey", NULL);
+    set = Ns_ConfigGetSection(Ns_ConfigGetPath(server, module,
+                                               "shards", NULL));
+    if (myCfg->shardKey == NULL && set == NULL) {
+        return NS_OK;
+    }
+    if (myCfg->shardKey == NULL || set == NULL || Ns_SetSize(set) == 0) {
+        Ns_Log(Error, "dbimy[%s]: sharded pool needs a shardkey "
+               "and a shards section", module);
+        return NS_ERROR;
+    }
+
+    map = Ns_ConfigString(path, "shardmap", "hash");
+    if (STRIEQ(map, "range")) {
+        myCfg->shardMap = MY_SHARD_RANGE;
+    } else if (STRIEQ(map, "hash")) {
+        myCfg->shardMap = MY_SHARD_HASH;
+    } else {
+        Ns_Log(Error, "dbimy[%s]: invalid shardmap: %s", module, map);
+        return NS_ERROR;
+    }
+
+    myCfg->numShards = Ns_SetSize(set);
+    myCfg->shards = ns_calloc(myCfg->numShards, sizeof(MyShard));
+
+    for (i = 0; i < myCfg->numShards; i++) {
+        shardPtr = &myCfg->shards[i];
+        shardPtr->name = Ns_SetKey(set, i);
+
+        if (Tcl_SplitList(NULL, Ns_SetValue(set, i), &shardPtr->numHosts,
+                          &shardPtr->hosts) != TCL_OK
+                || shardPtr->numHosts == 0) {
+            Ns_Log(Error, "dbimy[%s]: invalid host list for shard %s",
+                   module, shardPtr->name);
+            return NS_ERROR;
+        }
+        shardPtr->ports = ns_malloc(shardPtr->numHosts * sizeof(int));
+        for (j = 0; j < shardPtr->numHosts; j++) {
+            host = ns_strdup(shardPtr->hosts[j]);
+            if ((end = strrchr(host, ':')) != NULL) {
+                *end++ = '\0';
+                shardPtr->ports[j] = atoi(end);
+            } else {
+                shardPtr->ports[j] = myCfg->port;
+            }
+            shardPtr->hosts[j] = host;
+        }
+
+        if (myCfg->shardMap == MY_SHARD_RANGE) {
+            shardPtr->lower = strtoll(shardPtr->name, &end, 10);
+            if (*shardPtr->name == '\0' || *end != '\0') {
+                Ns_Log(Error, "dbimy[%s]: range shard name is not "
+                       "an integer: %s", module, shardPtr->name);
+                return NS_ERROR;
+            }
+        }
+    }
+
+    if (myCfg->shardMap == MY_SHARD_RANGE) {
+        qsort(myCfg->shards, myCfg->numShards, sizeof(MyShard),
+              CompareShards);
+    } else {
+        myCfg->numPoints = myCfg->numShards * MY_SHARD_POINTS;
+        myCfg->ring = ns_malloc(myCfg->numPoints * sizeof(MyPoint));
+        Tcl_DStringInit(&ds);
+        for (i = 0; i < myCfg->numShards; i++) {
+            for (j = 0; j < MY_SHARD_POINTS; j++) {
+                Tcl_DStringSetLength(&ds, 0);
+                Ns_DStringPrintf(&ds, "%s#%d", myCfg->shards[i].name, j);
+                myCfg->ring[i * MY_SHARD_POINTS + j].hash =
+                    Hash32(ds.string, (size_t) ds.length);
+                myCfg->ring[i * MY_SHARD_POINTS + j].shard = i;
+            }
+        }
+        Tcl_DStringFree(&ds);
+        qsort(myCfg->ring, myCfg->numPoints, sizeof(MyPoint),
+              ComparePoints);
     }
-    Dbi_SetException(handle, mysql_stmt_sqlstate(st),
-                     mysql_stmt_error(st));
+
+    (void) Tcl_CreateHashEntry(&shardKeys, myCfg->shardKey, &new);
+    Tcl_DStringInit(&ds);
+    Ns_DStringPrintf(&ds, "dbimy:shard:%s=", myCfg->shardKey);
+    myCfg->shardTag = ns_strdup(ds.string);
+    Tcl_DStringFree(&ds);
+
+    return NS_OK;
 }
 
-
+static int
+CompareShards(const void *a, const void *b)
+{
+    Tcl_WideInt x = ((MyShard *) a)->lower, y = ((MyShard *) b)->lower;
+
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static int
+ComparePoints(const void *a, const void *b)
+{
+    unsigned int x = ((MyPoint *) a)->hash, y = ((MyPoint *) b)->hash;
+
+    return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+
 /*
  *----------------------------------------------------------------------
  *
- * InitThread, CleanupThread --
- *
- *      Initialise and cleanup msql thread data for each thread
- *      that calls a mysql_* function.
- *
- *      InitThread is called from Open, Prepare and Exec, the 3 functions
- *      which a thread must call before calling any other dbi functions.
+ * ShardOf --
  *
- *      CleanupThread is a Tls callback which gets called only when a
- *      thread exits.
+ *      Find the shard for a shard key value. A hash map places the
+ *      value on a ring of points, so adding a shard moves only the
+ *      keys of the ring segments it takes over. A range map parses
+ *      the value as an integer.
  *
  * Results:
- *      None.
+ *      Index of shard, or -1 with sqlstate and message of the error.
  *
  * Side effects:
- *      MySQL memory is freed on thread exit.
+ *      None.
  *
  *----------------------------------------------------------------------
  */
 
-static void
-InitThread(void)
+static int
+ShardOf(MyConfig *myCfg, Dbi_Value *valuePtr,
+        CONST char **sqlstatePtr, CONST char **msgPtr)
 {
-    int initialised;
-
-    initialised = (int) Ns_TlsGet(&tls);
-    if (!initialised) {
-        Ns_TlsSet(&tls, (void *) NS_TRUE);
-        Ns_Log(Debug, "dbimy: InitThread");
-        mysql_thread_init();
+    Tcl_WideInt   key;
+    unsigned int  hash;
+    char          buf[32], *end;
+    int           lo, hi, mid;
+
+    if (valuePtr->data == NULL) {
+        *sqlstatePtr = "22004";
+        *msgPtr = "is null";
+        return -1;
     }
-}
 
-static void
-CleanupThread(void *arg)
-{
-    int initialised = (int) arg;
+    if (myCfg->shardMap == MY_SHARD_HASH) {
+        hash = Hash32(valuePtr->data, valuePtr->length);
+        lo = 0;
+        hi = myCfg->numPoints;
+        while (lo < hi) {
+            mid = (lo + hi) / 2;
+            if (myCfg->ring[mid].hash < hash) {
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        return myCfg->ring[lo < myCfg->numPoints ? lo : 0].shard;
+    }
 
-    if (initialised) {
-        Ns_Log(Debug, "dbimy: CleanupThread");
-        mysql_thread_end();
+    key = 0;
+    end = buf;
+    if (valuePtr->length > 0 && valuePtr->length < sizeof(buf)) {
+        memcpy(buf, valuePtr->data, valuePtr->length);
+        buf[valuePtr->length] = '\0';
+        key = strtoll(buf, &end, 10);
+    }
+    if (end == buf || *end != '\0') {
+        *sqlstatePtr = "22018";
+        *msgPtr = "is not an integer";
+        return -1;
+    }
+    if (key < myCfg->shards[0].lower) {
+        *sqlstatePtr = "22003";
+        *msgPtr = "is below the first range";
+        return -1;
+    }
+    for (mid = myCfg->numShards - 1; myCfg->shards[mid].lower > key; mid--) {
+        ;
+    }
+    return mid;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Hash32 --
+ *
+ *      FNV-1a with a final mix, so that similar keys and shard point
+ *      names spread over the whole ring.
+ *
+ * Results:
+ *      32 bit hash.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static unsigned int
+Hash32(CONST char *bytes, size_t length)
+{
+    uint32_t hash = 2166136261U;
+    size_t   i;
+
+    for (i = 0; i < length; i++) {
+        hash = (hash ^ UCHAR(bytes[i])) * 16777619U;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6bU;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35U;
+    hash ^= hash >> 16;
+
+    return hash;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ShardConnect --
+ *
+ *      Connect a handle to a shard, trying each of its hosts in turn.
+ *
+ * Results:
+ *      Connection or NULL with exception set.
+ *
+ * Side effects:
+ *      Failing to connect doesn't mark the handle as lost: its other
+ *      connections are still good.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static MYSQL *
+ShardConnect(Dbi_Handle *handle, MyHandle *myHandle, int shard)
+{
+    MyConfig *myCfg    = myHandle->myCfg;
+    MyShard  *shardPtr = &myCfg->shards[shard];
+    MYSQL    *conn     = NULL;
+    int       i, compressed;
+
+    myHandle->connecting = 1;
+    for (i = 0; i < shardPtr->numHosts && conn == NULL; i++) {
+        conn = Connect(handle, myCfg, shardPtr->hosts[i], shardPtr->ports[i],
+                       NULL, &compressed);
+        if (conn == NULL && i + 1 < shardPtr->numHosts) {
+            Dbi_LogException(handle, Warning);
+        }
+    }
+    myHandle->connecting = 0;
+
+    myHandle->shardConns[shard] = conn;
+
+    return conn;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ShardStatement --
+ *
+ *      Make sure a statement is prepared on the connection to a shard.
+ *
+ * Results:
+ *      NS_OK or NS_ERROR.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ShardStatement(Dbi_Handle *handle, Dbi_Statement *stmt, MyStatement *myStmt,
+               int shard)
+{
+    MyHandle   *myHandle = handle->driverData;
+    MYSQL_STMT *st;
+
+    if (myStmt->shardSts[shard] != NULL) {
+        return NS_OK;
+    }
+    if ((st = mysql_stmt_init(myHandle->shardConns[shard])) == NULL) {
+        Ns_Fatal("dbimy: Prepare: out of memory allocating statement.");
+    }
+    if (mysql_stmt_prepare(st, stmt->sql, stmt->length)) {
+        MyException(handle, st);
+        mysql_stmt_close(st);
+        return NS_ERROR;
+    }
+    if (mysql_stmt_field_count(st) != myStmt->numCols) {
+        Dbi_SetException(handle, "HY000", "statement has %u columns "
+                         "on shard %s, expected %u",
+                         mysql_stmt_field_count(st),
+                         myHandle->myCfg->shards[shard].name,
+                         myStmt->numCols);
+        mysql_stmt_close(st);
+        return NS_ERROR;
+    }
+    myStmt->shardSts[shard] = st;
+
+    return NS_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Route --
+ *
+ *      Pick the shard a statement runs on: by the value of its
+ *      shard key, else the shard of the current transaction, else
+ *      the first shard. A transaction stays on one shard.
+ *
+ * Results:
+ *      NS_OK or NS_ERROR.
+ *
+ * Side effects:
+ *      The handle and statement are switched to the shard. A pending
+ *      transaction is begun on it.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+Route(Dbi_Handle *handle, Dbi_Statement *stmt, MyStatement *myStmt,
+      Dbi_Value *values, unsigned int numValues)
+{
+    MyHandle     *myHandle = handle->driverData;
+    MyConfig     *myCfg    = myHandle->myCfg;
+    CONST char   *sqlstate, *msg;
+    unsigned int  depth;
+    int           shard;
+
+    if (myStmt->shardIdx >= 0 && myStmt->shardIdx < (int) numValues) {
+        shard = ShardOf(myCfg, &values[myStmt->shardIdx], &sqlstate, &msg);
+        if (shard < 0) {
+            Dbi_SetException(handle, sqlstate, "shard key %s %s",
+                             myCfg->shardKey, msg);
+            return NS_ERROR;
+        }
+    } else if (myHandle->txShard >= 0) {
+        shard = myHandle->txShard;
+    } else {
+        shard = 0;
+    }
+
+    if (myHandle->txShard >= 0 && shard != myHandle->txShard) {
+        Dbi_SetException(handle, "0A000", "statement for shard %s "
+                         "in transaction on shard %s",
+                         myCfg->shards[shard].name,
+                         myCfg->shards[myHandle->txShard].name);
+        return NS_ERROR;
+    }
+
+    if (myHandle->shardConns[shard] == NULL
+            && ShardConnect(handle, myHandle, shard) == NULL) {
+        return NS_ERROR;
+    }
+    if (ShardStatement(handle, stmt, myStmt, shard) != NS_OK) {
+        return NS_ERROR;
+    }
+    myHandle->conn  = myHandle->shardConns[shard];
+    myHandle->shard = shard;
+    myStmt->st      = myStmt->shardSts[shard];
+
+    if (myHandle->txPending) {
+        myHandle->txPending = 0;
+        myHandle->txShard   = shard;
+        for (depth = 0; depth <= myHandle->txDepth; depth++) {
+            if (Transaction(handle, depth, Dbi_TransactionBegin,
+                            myHandle->txIsolation) != NS_OK) {
+                return NS_ERROR;
+            }
+        }
+    }
+
+    return NS_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Scatter --
+ *
+ *      Run a statement marked dbimy:scatter on every shard at once,
+ *      this thread querying the first shard and the pool's scatter
+ *      workers the others, and gather the rows of the first result
+ *      set of each, in shard order, for NextRow to return.
+ *
+ * Results:
+ *      NS_OK or NS_ERROR.
+ *
+ * Side effects:
+ *      Connects to, and prepares the statement on, every shard.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+Scatter(Dbi_Handle *handle, Dbi_Statement *stmt, MyStatement *myStmt,
+        Dbi_Value *values, unsigned int numValues)
+{
+    MyHandle      *myHandle = handle->driverData;
+    MyConfig      *myCfg    = myHandle->myCfg;
+    MyScatterPool *pool     = myCfg->scatter;
+    MyScatter     *jobs, *jobPtr;
+    MyCell        *cells, *src;
+    size_t         numRows, offset, n;
+    unsigned int   j;
+    int            i, status = NS_OK;
+
+    if (myHandle->txShard >= 0 || myHandle->txPending) {
+        Dbi_SetException(handle, "0A000", "scatter query in a transaction");
+        return NS_ERROR;
+    }
+    for (i = 0; i < myCfg->numShards; i++) {
+        if (myHandle->shardConns[i] == NULL
+                && ShardConnect(handle, myHandle, i) == NULL) {
+            return NS_ERROR;
+        }
+        if (ShardStatement(handle, stmt, myStmt, i) != NS_OK) {
+            return NS_ERROR;
+        }
+    }
+
+    for (j = 0; j < myStmt->numCols; j++) {
+        myStmt->capBinary[j] = myStmt->columns[j].binary;
+    }
+
+    jobs = ns_calloc(myCfg->numShards, sizeof(MyScatter));
+    for (i = 0; i < myCfg->numShards; i++) {
+        jobPtr = &jobs[i];
+        jobPtr->shard     = myCfg->shards[i].name;
+        jobPtr->st        = myStmt->shardSts[i];
+        jobPtr->numCols   = myStmt->numCols;
+        jobPtr->binary    = myStmt->capBinary;
+        jobPtr->values    = values;
+        jobPtr->numValues = numValues;
+        Tcl_DStringInit(&jobPtr->cells);
+        Tcl_DStringInit(&jobPtr->data);
+        Tcl_DStringInit(&jobPtr->error);
+    }
+
+    /*
+     * The first shard is queried by this thread, and so is any other
+     * which no worker has taken by then.
+     */
+
+    Ns_MutexLock(&pool->lock);
+    for (i = 1; i < myCfg->numShards; i++) {
+        if (pool->lastPtr != NULL) {
+            pool->lastPtr->nextPtr = &jobs[i];
+        } else {
+            pool->firstPtr = &jobs[i];
+        }
+        pool->lastPtr = &jobs[i];
+    }
+    Ns_CondBroadcast(&pool->cond);
+    Ns_MutexUnlock(&pool->lock);
+
+    ScatterShard(&jobs[0]);
+
+    Ns_MutexLock(&pool->lock);
+    for (i = 1; i < myCfg->numShards; i++) {
+        if (ScatterTake(pool, &jobs[i])) {
+            Ns_MutexUnlock(&pool->lock);
+            ScatterShard(&jobs[i]);
+            Ns_MutexLock(&pool->lock);
+            jobs[i].done = 1;
+        }
+    }
+    for (i = 1; i < myCfg->numShards; i++) {
+        while (!jobs[i].done) {
+            Ns_CondWait(&pool->doneCond, &pool->lock);
+        }
+    }
+    Ns_MutexUnlock(&pool->lock);
+
+    numRows = 0;
+    for (i = 0; i < myCfg->numShards; i++) {
+        numRows += jobs[i].numRows;
+    }
+    if (numRows > myStmt->capAvail) {
+        myStmt->capAvail = numRows;
+        myStmt->capCells = ns_realloc(myStmt->capCells, numRows
+                                      * myStmt->numCols * sizeof(MyCell));
+    }
+    cells = myStmt->capCells;
+    Tcl_DStringSetLength(&myStmt->capData, 0);
+
+    for (i = 0; i < myCfg->numShards; i++) {
+        jobPtr = &jobs[i];
+        if (jobPtr->errnum != 0 && status == NS_OK) {
+            SetException(handle, jobPtr->errnum, jobPtr->sqlstate,
+                         jobPtr->error.string);
+            status = NS_ERROR;
+        }
+        if (status == NS_OK) {
+            offset = myStmt->capData.length;
+            src = (MyCell *) jobPtr->cells.string;
+            for (n = 0; n < jobPtr->numRows * myStmt->numCols; n++) {
+                cells->offset = src[n].offset + offset;
+                cells->length = src[n].length;
+                cells->null   = src[n].null;
+                cells++;
+            }
+            Tcl_DStringAppend(&myStmt->capData, jobPtr->data.string,
+                              jobPtr->data.length);
+        }
+        Tcl_DStringFree(&jobPtr->cells);
+        Tcl_DStringFree(&jobPtr->data);
+        Tcl_DStringFree(&jobPtr->error);
+    }
+    ns_free(jobs);
+
+    if (status == NS_OK) {
+        myStmt->capRows  = numRows;
+        myStmt->nextRow  = 0;
+        myStmt->gathered = 1;
+        myStmt->data     = myStmt->capData.string;
+        myStmt->binary   = myStmt->capBinary;
+    }
+
+    return status;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ScatterCreate --
+ *
+ *      Start the scatter workers of a sharded pool, scatterthreads
+ *      of them, by default one for each shard but the first. Scatter
+ *      queries running at the same time share the workers, and each
+ *      query runs the parts no worker is free to take itself.
+ *
+ * Results:
+ *      Scatter pool, or NULL if not a sharded pool.
+ *
+ * Side effects:
+ *      Workers run until server shutdown.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static MyScatterPool *
+ScatterCreate(MyConfig *myCfg, CONST char *path)
+{
+    MyScatterPool *pool;
+    int            i;
+
+    if (myCfg->numShards == 0) {
+        return NULL;
+    }
+
+    pool = ns_calloc(1, sizeof(MyScatterPool));
+    pool->numThreads = Ns_ConfigIntRange(path, "scatterthreads",
+                                         myCfg->numShards - 1, 0, INT_MAX);
+    pool->threads = ns_calloc(pool->numThreads + 1, sizeof(Ns_Thread));
+    Ns_MutexInit(&pool->lock);
+    Ns_MutexSetName2(&pool->lock, "dbimy:scatter", myCfg->module);
+    Ns_CondInit(&pool->cond);
+    Ns_CondInit(&pool->doneCond);
+
+    myCfg->scatter = pool;
+    pool->numRunning = pool->numThreads;
+    for (i = 0; i < pool->numThreads; i++) {
+        Ns_ThreadCreate(ScatterThread, myCfg, 0, &pool->threads[i]);
+    }
+    Ns_RegisterAtShutdown(ScatterShutdown, myCfg);
+    Ns_RegisterProcInfo(ScatterShutdown, "dbimy:scatter", NULL);
+
+    return pool;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ScatterThread --
+ *
+ *      Run the queued parts of scatter queries.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Exits after ScatterShutdown.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ScatterThread(void *arg)
+{
+    MyConfig      *myCfg = arg;
+    MyScatterPool *pool  = myCfg->scatter;
+    MyScatter     *jobPtr;
+
+    Ns_ThreadSetName("-dbimy:scatter:%s-", myCfg->module);
+
+    Ns_MutexLock(&pool->lock);
+    while (!pool->stop) {
+        if ((jobPtr = pool->firstPtr) == NULL) {
+            Ns_CondWait(&pool->cond, &pool->lock);
+            continue;
+        }
+        (void) ScatterTake(pool, jobPtr);
+        Ns_MutexUnlock(&pool->lock);
+        ScatterShard(jobPtr);
+        Ns_MutexLock(&pool->lock);
+        jobPtr->done = 1;
+        Ns_CondBroadcast(&pool->doneCond);
+    }
+    pool->numRunning--;
+    Ns_CondBroadcast(&pool->doneCond);
+    Ns_MutexUnlock(&pool->lock);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ScatterTake --
+ *
+ *      Remove a job from the queue of jobs waiting for a worker.
+ *      Called with the pool locked.
+ *
+ * Results:
+ *      1 if the job was waiting, 0 if it was taken already.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ScatterTake(MyScatterPool *pool, MyScatter *jobPtr)
+{
+    MyScatter **nextPtrPtr = &pool->firstPtr, *prevPtr = NULL;
+
+    while (*nextPtrPtr != NULL && *nextPtrPtr != jobPtr) {
+        prevPtr = *nextPtrPtr;
+        nextPtrPtr = &prevPtr->nextPtr;
+    }
+    if (*nextPtrPtr == NULL) {
+        return 0;
+    }
+    *nextPtrPtr = jobPtr->nextPtr;
+    if (pool->lastPtr == jobPtr) {
+        pool->lastPtr = prevPtr;
+    }
+    jobPtr->nextPtr = NULL;
+
+    return 1;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ScatterShutdown --
+ *
+ *      Stop the scatter workers once they have finished the jobs
+ *      they are running, waiting until the server shutdown timeout.
+ *      Queries still running run their remaining parts themselves.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ScatterShutdown(const Ns_Time *toPtr, void *arg)
+{
+    MyConfig      *myCfg = arg;
+    MyScatterPool *pool  = myCfg->scatter;
+    int            i, numRunning;
+
+    Ns_MutexLock(&pool->lock);
+    if (toPtr == NULL) {
+        pool->stop = 1;
+        Ns_CondBroadcast(&pool->cond);
+        Ns_MutexUnlock(&pool->lock);
+        return;
+    }
+    while (pool->numRunning > 0
+           && Ns_CondTimedWait(&pool->doneCond, &pool->lock,
+                               toPtr) == NS_OK) {
+        ;
+    }
+    numRunning = pool->numRunning;
+    Ns_MutexUnlock(&pool->lock);
+
+    if (numRunning == 0) {
+        for (i = 0; i < pool->numThreads; i++) {
+            Ns_ThreadJoin(&pool->threads[i], NULL);
+        }
+    } else {
+        Ns_Log(Warning, "dbimy[%s]: scatter: timeout waiting for "
+               "%d workers", myCfg->module, numRunning);
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ScatterShard, ScatterFetch --
+ *
+ *      Run the part of a scatter query for one shard and copy out
+ *      the rows. Errors are left in the job for Scatter to report.
+ *
+ * Results:
+ *      ScatterFetch: NS_OK or NS_ERROR.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ScatterShard(MyScatter *jobPtr)
+{
+    MYSQL_STMT *st = jobPtr->st;
+
+    InitThread();
+
+    if (ScatterFetch(jobPtr) != NS_OK) {
+        jobPtr->errnum = mysql_stmt_errno(st);
+        strncpy(jobPtr->sqlstate, mysql_stmt_sqlstate(st), 5);
+        jobPtr->sqlstate[5] = '\0';
+        Ns_DStringPrintf(&jobPtr->error, "shard %s: %s",
+                         jobPtr->shard, mysql_stmt_error(st));
+        jobPtr->numRows = 0;
+    }
+}
+
+static int
+ScatterFetch(MyScatter *jobPtr)
+{
+    MYSQL_STMT    *st = jobPtr->st;
+    MYSQL_BIND     bind[DBI_MAX_BIND], col;
+    unsigned long  lengths[DBI_MAX_BIND];
+    my_bool        nulls[DBI_MAX_BIND], error;
+    MyCell         cell;
+    unsigned int   i;
+    int            rc;
+
+    if (BindParams(st, jobPtr->values, jobPtr->numValues)
+            || mysql_stmt_execute(st)) {
+        return NS_ERROR;
+    }
+
+    if (jobPtr->numCols > 0 && mysql_stmt_field_count(st) > 0) {
+
+        memset(bind, 0, sizeof(bind));
+        for (i = 0; i < jobPtr->numCols; i++) {
+            bind[i].buffer_type = jobPtr->binary[i]
+                ? MYSQL_TYPE_BLOB : MYSQL_TYPE_STRING;
+            bind[i].length  = &lengths[i];
+            bind[i].is_null = &nulls[i];
+        }
+        if (mysql_stmt_store_result(st)
+                || mysql_stmt_bind_result(st, bind)) {
+            return NS_ERROR;
+        }
+
+        while ((rc = mysql_stmt_fetch(st)) == 0
+               || rc == MYSQL_DATA_TRUNCATED) {
+            for (i = 0; i < jobPtr->numCols; i++) {
+                cell.offset = jobPtr->data.length;
+                cell.length = nulls[i] ? 0 : lengths[i];
+                cell.null   = nulls[i];
+                if (cell.length > 0) {
+                    Tcl_DStringSetLength(&jobPtr->data,
+                                         (int) (cell.offset + cell.length));
+                    memset(&col, 0, sizeof(col));
+                    col.buffer        = jobPtr->data.string + cell.offset;
+                    col.buffer_length = cell.length;
+                    col.buffer_type   = bind[i].buffer_type;
+                    col.error         = &error;
+                    if (mysql_stmt_fetch_column(st, &col, i, 0)) {
+                        return NS_ERROR;
+                    }
+                }
+                Tcl_DStringAppend(&jobPtr->cells, (char *) &cell,
+                                  sizeof(cell));
+            }
+            jobPtr->numRows++;
+        }
+        if (rc == 1) {
+            return NS_ERROR;
+        }
+    }
+
+    do {
+        if (mysql_stmt_free_result(st)) {
+            return NS_ERROR;
+        }
+    } while ((rc = mysql_stmt_next_result(st)) == 0);
+
+    return rc > 0 ? NS_ERROR : NS_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Serialize --
+ *
+ *      Fetch the whole result of a dbimy:json or dbimy:csv query and
+ *      serialize it straight from the fetch buffers: a JSON array of
+ *      objects keyed by column name, or CSV with a header row. The
+ *      result is replaced by one row and column holding the text or,
+ *      if it was streamed to the connection, the number of rows.
+ *
+ * Results:
+ *      NS_OK or NS_ERROR.
+ *
+ * Side effects:
+ *      A streamed result is written to the connection as it is
+ *      serialized, so the headers must have been set already.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+Serialize(Dbi_Handle *handle, Dbi_Statement *stmt, MyStatement *myStmt)
+{
+    MyHandle     *myHandle = handle->driverData;
+    Ns_Conn      *conn     = myStmt->stream ? Ns_GetConn() : NULL;
+    int           json     = myStmt->format == MY_FORMAT_JSON;
+    MyColumn     *column;
+    Tcl_DString   ds, keys, value;
+    int           kinds[DBI_MAX_BIND], keyOffsets[DBI_MAX_BIND + 1];
+    unsigned long numRows = 0;
+    unsigned int  i;
+    size_t        length;
+    int           binary, end = 0, status = NS_OK;
+
+    Tcl_DStringInit(&ds);
+    Tcl_DStringInit(&keys);
+    Tcl_DStringInit(&value);
+
+    /*
+     * The JSON keys, or the CSV header row.
+     */
+
+    for (i = 0; i < myStmt->numCols; i++) {
+        column = &myStmt->columns[i];
+        kinds[i] = JsonKind(column);
+        if (json) {
+            keyOffsets[i] = keys.length;
+            JsonString(&keys, column->name, strlen(column->name));
+            Tcl_DStringAppend(&keys, ":", 1);
+        } else {
+            if (i > 0) {
+                Tcl_DStringAppend(&ds, ",", 1);
+            }
+            CsvField(&ds, column->name, strlen(column->name));
+        }
+    }
+    keyOffsets[i] = keys.length;
+    Tcl_DStringAppend(&ds, json ? "[" : "\r\n", -1);
+
+    while (status == NS_OK) {
+        if (NextRow(handle, stmt, &end) != NS_OK) {
+            status = NS_ERROR;
+            break;
+        }
+        if (end) {
+            break;
+        }
+        if (json) {
+            Tcl_DStringAppend(&ds, numRows > 0 ? ",{" : "{", -1);
+        }
+        for (i = 0; i < myStmt->numCols && status == NS_OK; i++) {
+            ColumnLength(handle, stmt, i, &length, &binary);
+            Tcl_DStringSetLength(&value, (int) length);
+            if (length > 0
+                    && ColumnValue(handle, stmt, i, value.string,
+                                   length) != NS_OK) {
+                status = NS_ERROR;
+                break;
+            }
+            if (!json) {
+                if (i > 0) {
+                    Tcl_DStringAppend(&ds, ",", 1);
+                }
+                CsvField(&ds, value.string, length);
+                continue;
+            }
+            if (i > 0) {
+                Tcl_DStringAppend(&ds, ",", 1);
+            }
+            Tcl_DStringAppend(&ds, keys.string + keyOffsets[i],
+                              keyOffsets[i + 1] - keyOffsets[i]);
+
+            if (myStmt->cells != NULL
+                    ? myStmt->cells[i].null : myHandle->nulls[i]) {
+                Tcl_DStringAppend(&ds, "null", 4);
+            } else if (kinds[i] == MY_JSON_BINARY) {
+                JsonBase64(&ds, value.string, length);
+            } else if (kinds[i] == MY_JSON_STRING) {
+                JsonString(&ds, value.string, length);
+            } else {
+                Tcl_DStringAppend(&ds, value.string, (int) length);
+            }
+        }
+        Tcl_DStringAppend(&ds, json ? "}" : "\r\n", -1);
+        numRows++;
+
+        if (status == NS_OK && conn != NULL && ds.length >= MY_STREAM_CHUNK) {
+            if (Ns_ConnWriteData(conn, ds.string, (size_t) ds.length,
+                                 NS_CONN_STREAM) != NS_OK) {
+                Dbi_SetException(handle, "HY000",
+                                 "dbimy: writing result to connection failed");
+                status = NS_ERROR;
+            }
+            Tcl_DStringSetLength(&ds, 0);
+        }
+    }
+    if (json) {
+        Tcl_DStringAppend(&ds, "]", 1);
+    }
+
+    if (status == NS_OK && conn != NULL) {
+        if (Ns_ConnWriteData(conn, ds.string, (size_t) ds.length,
+                             NS_CONN_STREAM) != NS_OK) {
+            Dbi_SetException(handle, "HY000",
+                             "dbimy: writing result to connection failed");
+            status = NS_ERROR;
+        }
+        Tcl_DStringSetLength(&ds, 0);
+        Ns_DStringPrintf(&ds, "%lu", numRows);
+    }
+
+    if (status == NS_OK) {
+        SetResultValue(myHandle->myCfg->cache, myStmt, ds.string, ds.length);
+    }
+
+    Tcl_DStringFree(&ds);
+    Tcl_DStringFree(&keys);
+    Tcl_DStringFree(&value);
+
+    return status;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SetResultValue --
+ *
+ *      Replace the result of a statement with a single text value,
+ *      replayed through NextRow like a gathered result.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Any cached or captured result is released.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+SetResultValue(MyCache *cache, MyStatement *myStmt,
+               CONST char *value, int length)
+{
+    CacheRelease(cache, myStmt);
+
+    if (myStmt->capAvail == 0) {
+        myStmt->capAvail = 1;
+        myStmt->capCells = ns_realloc(myStmt->capCells, (myStmt->numCols > 0
+                                      ? myStmt->numCols : 1) * sizeof(MyCell));
+    }
+    Tcl_DStringAppend(&myStmt->capData, value, length);
+    myStmt->capCells[0].offset = 0;
+    myStmt->capCells[0].length = (size_t) length;
+    myStmt->capCells[0].null   = 0;
+    myStmt->capBinary[0] = 0;
+    myStmt->capRows  = 1;
+    myStmt->nextRow  = 0;
+    myStmt->gathered = 1;
+    myStmt->data     = myStmt->capData.string;
+    myStmt->binary   = myStmt->capBinary;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Describe --
+ *
+ *      Append the metadata of each result column of a statement as
+ *      a Tcl list of dicts with the keys name, type, length,
+ *      decimals, unsigned, notnull, charset and table.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+Describe(MyStatement *myStmt, Tcl_DString *dsPtr)
+{
+    MyColumn     *column;
+    unsigned int  i;
+    char          buf[TCL_INTEGER_SPACE];
+
+    for (i = 0; i < myStmt->numCols; i++) {
+        column = &myStmt->columns[i];
+
+        Tcl_DStringStartSublist(dsPtr);
+        Tcl_DStringAppendElement(dsPtr, "name");
+        Tcl_DStringAppendElement(dsPtr, column->name);
+        Tcl_DStringAppendElement(dsPtr, "type");
+        Tcl_DStringAppendElement(dsPtr, TypeName(column));
+        Tcl_DStringAppendElement(dsPtr, "length");
+        snprintf(buf, sizeof(buf), "%lu", column->length);
+        Tcl_DStringAppendElement(dsPtr, buf);
+        Tcl_DStringAppendElement(dsPtr, "decimals");
+        snprintf(buf, sizeof(buf), "%u", column->decimals);
+        Tcl_DStringAppendElement(dsPtr, buf);
+        Tcl_DStringAppendElement(dsPtr, "unsigned");
+        Tcl_DStringAppendElement(dsPtr,
+            (column->flags & UNSIGNED_FLAG) ? "1" : "0");
+        Tcl_DStringAppendElement(dsPtr, "notnull");
+        Tcl_DStringAppendElement(dsPtr,
+            (column->flags & NOT_NULL_FLAG) ? "1" : "0");
+        Tcl_DStringAppendElement(dsPtr, "charset");
+        snprintf(buf, sizeof(buf), "%u", column->charsetnr);
+        Tcl_DStringAppendElement(dsPtr, buf);
+        Tcl_DStringAppendElement(dsPtr, "table");
+        Tcl_DStringAppendElement(dsPtr, column->table);
+        Tcl_DStringEndSublist(dsPtr);
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * TypeName --
+ *
+ *      The SQL name of the type of a column.
+ *
+ * Results:
+ *      Static string, e.g. "int" or "varchar".
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static CONST char *
+TypeName(MyColumn *column)
+{
+    int binary = column->charsetnr == 63;
+
+    switch (column->type) {
+    case MYSQL_TYPE_TINY:        return "tinyint";
+    case MYSQL_TYPE_SHORT:       return "smallint";
+    case MYSQL_TYPE_INT24:       return "mediumint";
+    case MYSQL_TYPE_LONG:        return "int";
+    case MYSQL_TYPE_LONGLONG:    return "bigint";
+    case MYSQL_TYPE_DECIMAL:
+    case MYSQL_TYPE_NEWDECIMAL:  return "decimal";
+    case MYSQL_TYPE_FLOAT:       return "float";
+    case MYSQL_TYPE_DOUBLE:      return "double";
+    case MYSQL_TYPE_BIT:         return "bit";
+    case MYSQL_TYPE_YEAR:        return "year";
+    case MYSQL_TYPE_DATE:
+    case MYSQL_TYPE_NEWDATE:     return "date";
+    case MYSQL_TYPE_TIME:        return "time";
+    case MYSQL_TYPE_DATETIME:    return "datetime";
+    case MYSQL_TYPE_TIMESTAMP:   return "timestamp";
+    case MYSQL_TYPE_NULL:        return "null";
+    case MYSQL_TYPE_ENUM:        return "enum";
+    case MYSQL_TYPE_SET:         return "set";
+    case MYSQL_TYPE_GEOMETRY:    return "geometry";
+    case 245:                    return "json";
+    case MYSQL_TYPE_TINY_BLOB:
+    case MYSQL_TYPE_MEDIUM_BLOB:
+    case MYSQL_TYPE_LONG_BLOB:
+    case MYSQL_TYPE_BLOB:        return binary ? "blob" : "text";
+    case MYSQL_TYPE_VARCHAR:
+    case MYSQL_TYPE_VAR_STRING:  return binary ? "varbinary" : "varchar";
+    case MYSQL_TYPE_STRING:
+        /* Enums and sets are sent as strings. */
+        if (column->flags & ENUM_FLAG) {
+            return "enum";
+        }
+        if (column->flags & SET_FLAG) {
+            return "set";
+        }
+        return binary ? "binary" : "char";
+    default:
+        return "unknown";
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * JsonKind --
+ *
+ *      Decide how values of a column are written in JSON.
+ *
+ * Results:
+ *      MY_JSON_STRING, _NUMBER, _DOCUMENT or _BINARY.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+JsonKind(MyColumn *column)
+{
+    switch (column->type) {
+    case MYSQL_TYPE_TINY:
+    case MYSQL_TYPE_SHORT:
+    case MYSQL_TYPE_INT24:
+    case MYSQL_TYPE_LONG:
+    case MYSQL_TYPE_LONGLONG:
+    case MYSQL_TYPE_YEAR:
+    case MYSQL_TYPE_DECIMAL:
+    case MYSQL_TYPE_NEWDECIMAL:
+    case MYSQL_TYPE_FLOAT:
+    case MYSQL_TYPE_DOUBLE:
+        return MY_JSON_NUMBER;
+
+    case 245: /* MYSQL_TYPE_JSON, MySQL 5.7 and later. */
+        return MY_JSON_DOCUMENT;
+
+    case MYSQL_TYPE_BIT:
+    case MYSQL_TYPE_GEOMETRY:
+        return MY_JSON_BINARY;
+
+    case MYSQL_TYPE_STRING:
+    case MYSQL_TYPE_VAR_STRING:
+    case MYSQL_TYPE_VARCHAR:
+    case MYSQL_TYPE_BLOB:
+    case MYSQL_TYPE_TINY_BLOB:
+    case MYSQL_TYPE_MEDIUM_BLOB:
+    case MYSQL_TYPE_LONG_BLOB:
+        /* Character set 63 is binary. */
+        return column->charsetnr == 63 ? MY_JSON_BINARY : MY_JSON_STRING;
+
+    default:
+        return MY_JSON_STRING;
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * JsonString, JsonBase64, CsvField --
+ *
+ *      Append a value as a quoted and escaped JSON string, as a
+ *      JSON string of the base64 encoded bytes, or as a CSV field
+ *      quoted if it contains a comma, quote or line break.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+JsonString(Tcl_DString *dsPtr, CONST char *value, size_t length)
+{
+    CONST char *start, *end = value + length;
+    char        buf[8];
+
+    Tcl_DStringAppend(dsPtr, "\"", 1);
+    for (start = value; value < end; value++) {
+        if (UCHAR(*value) >= 0x20 && *value != '"' && *value != '\\') {
+            continue;
+        }
+        Tcl_DStringAppend(dsPtr, start, (int) (value - start));
+        switch (*value) {
+        case '"':  Tcl_DStringAppend(dsPtr, "\\\"", 2); break;
+        case '\\': Tcl_DStringAppend(dsPtr, "\\\\", 2); break;
+        case '\n': Tcl_DStringAppend(dsPtr, "\\n", 2);  break;
+        case '\r': Tcl_DStringAppend(dsPtr, "\\r", 2);  break;
+        case '\t': Tcl_DStringAppend(dsPtr, "\\t", 2);  break;
+        default:
+            snprintf(buf, sizeof(buf), "\\u%04x", UCHAR(*value));
+            Tcl_DStringAppend(dsPtr, buf, 6);
+        }
+        start = value + 1;
+    }
+    Tcl_DStringAppend(dsPtr, start, (int) (end - start));
+    Tcl_DStringAppend(dsPtr, "\"", 1);
+}
+
+static void
+JsonBase64(Tcl_DString *dsPtr, CONST char *value, size_t length)
+{
+    static CONST char digits[] =
+        "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    CONST unsigned char *p = (CONST unsigned char *) value;
+    unsigned long        n;
+    size_t               i;
+    char                *out;
+    int                  offset;
+
+    offset = dsPtr->length;
+    Tcl_DStringSetLength(dsPtr, offset + 2 + (int) ((length + 2) / 3 * 4));
+    out = dsPtr->string + offset;
+    *out++ = '"';
+    for (i = 0; i + 2 < length; i += 3) {
+        n = (unsigned long) p[i] << 16 | p[i + 1] << 8 | p[i + 2];
+        *out++ = digits[n >> 18];
+        *out++ = digits[n >> 12 & 63];
+        *out++ = digits[n >> 6 & 63];
+        *out++ = digits[n & 63];
+    }
+    if (i < length) {
+        n = (unsigned long) p[i] << 16 | (i + 1 < length ? p[i + 1] << 8 : 0);
+        *out++ = digits[n >> 18];
+        *out++ = digits[n >> 12 & 63];
+        *out++ = i + 1 < length ? digits[n >> 6 & 63] : '=';
+        *out++ = '=';
+    }
+    *out = '"';
+}
+
+static void
+CsvField(Tcl_DString *dsPtr, CONST char *value, size_t length)
+{
+    CONST char *start, *end = value + length;
+
+    for (start = value; start < end; start++) {
+        if (*start == ',' || *start == '"'
+                || *start == '\r' || *start == '\n') {
+            break;
+        }
+    }
+    if (start == end) {
+        Tcl_DStringAppend(dsPtr, value, (int) length);
+        return;
+    }
+    Tcl_DStringAppend(dsPtr, "\"", 1);
+    for (start = value; value < end; value++) {
+        if (*value == '"') {
+            Tcl_DStringAppend(dsPtr, start, (int) (value - start) + 1);
+            start = value;
+        }
+    }
+    Tcl_DStringAppend(dsPtr, start, (int) (end - start));
+    Tcl_DStringAppend(dsPtr, "\"", 1);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CacheCreate --
+ *
+ *      Create the result cache for a pool if a cachesize is
+ *      configured.
+ *
+ * Results:
+ *      Pointer to MyCache or NULL if caching is disabled.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static MyCache *
+CacheCreate(CONST char *module, CONST char *path)
+{
+    MyCache    *cache;
+    CONST char *tables;
+    int         maxSize;
+
+    maxSize = Ns_ConfigIntRange(path, "cachesize", 0, 0, INT_MAX);
+    if (maxSize == 0) {
+        return NULL;
+    }
+
+    cache = ns_calloc(1, sizeof(MyCache));
+    cache->maxSize = (size_t) maxSize;
+    cache->ttl     = Ns_ConfigIntRange(path, "cachettl", 60, 1, INT_MAX);
+    Ns_MutexInit(&cache->lock);
+    Ns_MutexSetName2(&cache->lock, "dbimy:cache", module);
+    Tcl_InitHashTable(&cache->entries, TCL_ONE_WORD_KEYS);
+
+    tables = Ns_ConfigString(path, "cachetables", NULL);
+    if (tables != NULL
+            && Tcl_SplitList(NULL, tables, &cache->numTables,
+                             &cache->tables) != TCL_OK) {
+        Ns_Log(Error, "dbimy[%s]: invalid cachetables: %s", module, tables);
+        cache->numTables = 0;
+    }
+    if (cache->numTables > 32) {
+        Ns_Log(Warning, "dbimy[%s]: only the first 32 cachetables are used",
+               module);
+        cache->numTables = 32;
+    }
+
+    return cache;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CacheTables --
+ *
+ *      Find which of the configured cache tables are mentioned in
+ *      an SQL statement. A write to any of them invalidates every
+ *      cached result which also mentions it.
+ *
+ * Results:
+ *      Bit mask of cache tables.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+#define IsWordChar(c) (isalnum(UCHAR(c)) || (c) == '_' || (c) == '$')
+
+static unsigned int
+CacheTables(MyCache *cache, CONST char *sql)
+{
+    CONST char   *start;
+    size_t        length;
+    unsigned int  tables = 0;
+    int           i;
+
+    while (*sql != '\0') {
+        if (!IsWordChar(*sql)) {
+            sql++;
+            continue;
+        }
+        start = sql;
+        while (IsWordChar(*sql)) {
+            sql++;
+        }
+        length = sql - start;
+
+        for (i = 0; i < cache->numTables; i++) {
+            if (strlen(cache->tables[i]) == length
+                    && strncasecmp(start, cache->tables[i], length) == 0) {
+                tables |= 1U << i;
+            }
+        }
+    }
+
+    return tables;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CacheLookup --
+ *
+ *      Look for an unexpired cached result for the statement and
+ *      bind values.
+ *
+ * Results:
+ *      1 if found, 0 otherwise.
+ *
+ * Side effects:
+ *      The cache key and the generation of the tables read are left
+ *      in myStmt for a later CacheInsert. A found entry is referenced
+ *      by the statement until released.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+CacheLookup(MyCache *cache, MyStatement *myStmt, Dbi_Statement *stmt,
+            Dbi_Value *values, unsigned int numValues)
+{
+    Tcl_DString   *dsPtr = &myStmt->key;
+    Tcl_HashEntry *hPtr;
+    MyCacheEntry  *entryPtr = NULL;
+    size_t         length;
+    unsigned int   i;
+    char           type;
+
+    /*
+     * The key is the SQL followed by the type, length and
+     * bytes of each bound value.
+     */
+
+    Tcl_DStringSetLength(dsPtr, 0);
+    Tcl_DStringAppend(dsPtr, stmt->sql, stmt->length);
+    for (i = 0; i < numValues; i++) {
+        type   = values[i].data == NULL ? 'n' : (values[i].binary ? 'b' : 't');
+        length = values[i].length;
+        Tcl_DStringAppend(dsPtr, &type, 1);
+        Tcl_DStringAppend(dsPtr, (char *) &length, sizeof(length));
+        if (values[i].data != NULL) {
+            Tcl_DStringAppend(dsPtr, values[i].data, (int) length);
+        }
+    }
+
+    Ns_MutexLock(&cache->lock);
+    hPtr = Tcl_FindHashEntry(&cache->entries, CacheKey(dsPtr));
+    if (hPtr != NULL) {
+        entryPtr = Tcl_GetHashValue(hPtr);
+        if (entryPtr->expires < time(NULL)) {
+            CacheRemove(cache, entryPtr);
+            entryPtr = NULL;
+        } else if (entryPtr->keyLength != (size_t) dsPtr->length
+                   || memcmp(entryPtr->key, dsPtr->string,
+                             entryPtr->keyLength) != 0) {
+            entryPtr = NULL;
+        }
+    }
+    if (entryPtr != NULL) {
+        if (entryPtr != cache->firstPtr) {
+            entryPtr->prevPtr->nextPtr = entryPtr->nextPtr;
+            if (entryPtr->nextPtr != NULL) {
+                entryPtr->nextPtr->prevPtr = entryPtr->prevPtr;
+            } else {
+                cache->lastPtr = entryPtr->prevPtr;
+            }
+            entryPtr->prevPtr = NULL;
+            entryPtr->nextPtr = cache->firstPtr;
+            cache->firstPtr->prevPtr = entryPtr;
+            cache->firstPtr = entryPtr;
+        }
+        entryPtr->refCount++;
+        cache->hits++;
+    } else {
+        myStmt->generation = CacheGeneration(cache, myStmt->tables);
+        cache->misses++;
+    }
+    Ns_MutexUnlock(&cache->lock);
+
+    if (entryPtr == NULL) {
+        return 0;
+    }
+
+    myStmt->entryPtr = entryPtr;
+    myStmt->nextRow  = 0;
+    myStmt->data     = entryPtr->data;
+    myStmt->binary   = entryPtr->binary;
+
+    return 1;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CacheKey --
+ *
+ *      Hash a full cache key into a one-word hash table key.
+ *      Entries must still be compared against the full key.
+ *
+ * Results:
+ *      FNV-1a hash of the key.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static CONST char *
+CacheKey(Tcl_DString *dsPtr)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    int      i;
+
+    for (i = 0; i < dsPtr->length; i++) {
+        hash = (hash ^ UCHAR(dsPtr->string[i])) * 1099511628211ULL;
+    }
+    return (CONST char *) (uintptr_t) hash;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CaptureRow --
+ *
+ *      Copy the values of the current row so that the result can be
+ *      cached once all rows have been read. Results which grow too
+ *      large for the cache are abandoned.
+ *
+ * Results:
+ *      NS_OK or NS_ERROR.
+ *
+ * Side effects:
+ *      The row is served to the caller from the captured copy.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+CaptureRow(Dbi_Handle *handle, MyStatement *myStmt)
+{
+    MyHandle     *myHandle = handle->driverData;
+    MyCache      *cache    = myHandle->myCfg->cache;
+    MyCell       *cells;
+    size_t        length, size;
+    unsigned int  i;
+
+    size = (myStmt->capRows + 1) * myStmt->numCols * sizeof(MyCell)
+        + myStmt->capData.length;
+    for (i = 0; i < myStmt->numCols; i++) {
+        size += myHandle->nulls[i] ? 0 : myHandle->lengths[i];
+    }
+    if (size > cache->maxSize / 4) {
+        CacheRelease(cache, myStmt);
+        return NS_OK;
+    }
+
+    if (myStmt->capRows == myStmt->capAvail) {
+        myStmt->capAvail = myStmt->capAvail ? myStmt->capAvail * 2 : 16;
+        myStmt->capCells = ns_realloc(myStmt->capCells, myStmt->capAvail
+                                      * myStmt->numCols * sizeof(MyCell));
+    }
+    cells = myStmt->capCells + myStmt->capRows * myStmt->numCols;
+
+    for (i = 0; i < myStmt->numCols; i++) {
+        length = myHandle->nulls[i] ? 0 : myHandle->lengths[i];
+        cells[i].offset = myStmt->capData.length;
+        cells[i].length = length;
+        cells[i].null   = myHandle->nulls[i];
+        if (length > 0) {
+            Tcl_DStringSetLength(&myStmt->capData,
+                                 (int) (cells[i].offset + length));
+            if (FetchColumn(handle, myStmt, i,
+                            myStmt->capData.string + cells[i].offset,
+                            length) != NS_OK) {
+                CacheRelease(cache, myStmt);
+                return NS_ERROR;
+            }
+        }
+    }
+    myStmt->capRows++;
+
+    myStmt->cells  = cells;
+    myStmt->data   = myStmt->capData.string;
+    myStmt->binary = myStmt->capBinary;
+
+    return NS_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CacheInsert --
+ *
+ *      Add a completely captured result to the cache, evicting least
+ *      recently used entries to make space. A result is dropped if
+ *      one of the tables it read was written since it was executed,
+ *      as it may have been read before the write.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Capture buffers are reset.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+CacheInsert(MyCache *cache, MyStatement *myStmt)
+{
+    MyCacheEntry  *entryPtr, *oldPtr;
+    Tcl_HashEntry *hPtr;
+    size_t         cellsSize, size;
+    int            new;
+
+    cellsSize = myStmt->capRows * myStmt->numCols * sizeof(MyCell);
+    size = sizeof(MyCacheEntry) + cellsSize + myStmt->numCols
+        + myStmt->capData.length + myStmt->key.length;
+
+    if (size > cache->maxSize / 4) {
+        CacheRelease(cache, myStmt);
+        return;
+    }
+
+    entryPtr = ns_malloc(size);
+    entryPtr->prevPtr   = NULL;
+    entryPtr->refCount  = 0;
+    entryPtr->expires   = time(NULL) + cache->ttl;
+    entryPtr->tables    = myStmt->tables;
+    entryPtr->numCols   = myStmt->numCols;
+    entryPtr->numRows   = (unsigned int) myStmt->capRows;
+    entryPtr->size      = size;
+    entryPtr->keyLength = myStmt->key.length;
+
+    entryPtr->cells  = (MyCell *) (entryPtr + 1);
+    entryPtr->binary = (char *) entryPtr->cells + cellsSize;
+    entryPtr->data   = entryPtr->binary + myStmt->numCols;
+    entryPtr->key    = entryPtr->data + myStmt->capData.length;
+
+    memcpy(entryPtr->cells, myStmt->capCells, cellsSize);
+    memcpy(entryPtr->binary, myStmt->capBinary, myStmt->numCols);
+    memcpy(entryPtr->data, myStmt->capData.string, myStmt->capData.length);
+    memcpy(entryPtr->key, myStmt->key.string, myStmt->key.length);
+
+    CacheRelease(cache, myStmt);
+
+    Ns_MutexLock(&cache->lock);
+    if (CacheGeneration(cache, entryPtr->tables) != myStmt->generation) {
+        Ns_MutexUnlock(&cache->lock);
+        ns_free(entryPtr);
+        return;
+    }
+    hPtr = Tcl_CreateHashEntry(&cache->entries, CacheKey(&myStmt->key), &new);
+    if (!new) {
+        CacheRemove(cache, Tcl_GetHashValue(hPtr));
+        hPtr = Tcl_CreateHashEntry(&cache->entries,
+                                   CacheKey(&myStmt->key), &new);
+    }
+    Tcl_SetHashValue(hPtr, entryPtr);
+    entryPtr->hPtr = hPtr;
+
+    entryPtr->nextPtr = cache->firstPtr;
+    if (cache->firstPtr != NULL) {
+        cache->firstPtr->prevPtr = entryPtr;
+    } else {
+        cache->lastPtr = entryPtr;
+    }
+    cache->firstPtr = entryPtr;
+    cache->size += size;
+
+    while (cache->size > cache->maxSize
+           && (oldPtr = cache->lastPtr) != entryPtr) {
+        CacheRemove(cache, oldPtr);
+        cache->evictions++;
+    }
+    Ns_MutexUnlock(&cache->lock);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CacheInvalidate --
+ *
+ *      Remove all cached results which read any of the given
+ *      cache tables, and start a new generation of each so that
+ *      results executed before now are not cached.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+CacheInvalidate(MyCache *cache, unsigned int tables)
+{
+    MyCacheEntry *entryPtr, *nextPtr;
+    int           i;
+
+    Ns_MutexLock(&cache->lock);
+    for (i = 0; i < cache->numTables; i++) {
+        if (tables & (1u << i)) {
+            cache->generations[i]++;
+        }
+    }
+    for (entryPtr = cache->firstPtr; entryPtr != NULL; entryPtr = nextPtr) {
+        nextPtr = entryPtr->nextPtr;
+        if (entryPtr->tables & tables) {
+            CacheRemove(cache, entryPtr);
+            cache->invalidations++;
+        }
+    }
+    Ns_MutexUnlock(&cache->lock);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CacheGeneration --
+ *
+ *      Sum the generations of the given cache tables. The sum changes
+ *      whenever any of them is written. Called with the cache locked.
+ *
+ * Results:
+ *      Generation.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static unsigned long
+CacheGeneration(MyCache *cache, unsigned int tables)
+{
+    unsigned long generation = 0;
+    int           i;
+
+    for (i = 0; i < cache->numTables; i++) {
+        if (tables & (1u << i)) {
+            generation += cache->generations[i];
+        }
+    }
+
+    return generation;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CacheRelease --
+ *
+ *      Release the cached result a statement is replaying and
+ *      discard any partially captured or gathered result.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Entry is freed if it has been removed from the cache and
+ *      this was the last reference.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+CacheRelease(MyCache *cache, MyStatement *myStmt)
+{
+    MyCacheEntry *entryPtr = myStmt->entryPtr;
+
+    if (entryPtr != NULL) {
+        Ns_MutexLock(&cache->lock);
+        if (--entryPtr->refCount == 0 && entryPtr->hPtr == NULL) {
+            ns_free(entryPtr);
+        }
+        Ns_MutexUnlock(&cache->lock);
+        myStmt->entryPtr = NULL;
+    }
+
+    myStmt->fill     = 0;
+    myStmt->gathered = 0;
+    myStmt->capRows  = 0;
+    myStmt->cells    = NULL;
+    Tcl_DStringSetLength(&myStmt->capData, 0);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CacheRemove --
+ *
+ *      Remove an entry from the cache. Cache must be locked.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Entry is freed unless a statement is still replaying it.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+CacheRemove(MyCache *cache, MyCacheEntry *entryPtr)
+{
+    Tcl_DeleteHashEntry(entryPtr->hPtr);
+    entryPtr->hPtr = NULL;
+
+    if (entryPtr->prevPtr != NULL) {
+        entryPtr->prevPtr->nextPtr = entryPtr->nextPtr;
+    } else {
+        cache->firstPtr = entryPtr->nextPtr;
+    }
+    if (entryPtr->nextPtr != NULL) {
+        entryPtr->nextPtr->prevPtr = entryPtr->prevPtr;
+    } else {
+        cache->lastPtr = entryPtr->prevPtr;
+    }
+    cache->size -= entryPtr->size;
+
+    if (entryPtr->refCount == 0) {
+        ns_free(entryPtr);
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * WriterCreate --
+ *
+ *      Create the background write queue of a pool with a non-zero
+ *      writequeue, and start its writer thread.
+ *
+ * Results:
+ *      Pointer to MyWriter or NULL if not configured.
+ *
+ * Side effects:
+ *      The thread is stopped, after writing the rows still queued,
+ *      at server shutdown.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static MyWriter *
+WriterCreate(MyConfig *myCfg, CONST char *path)
+{
+    MyWriter *writer;
+    int       maxQueued;
+
+    maxQueued = Ns_ConfigIntRange(path, "writequeue", 0, 0, INT_MAX);
+    if (maxQueued == 0) {
+        return NULL;
+    }
+    if (myCfg->numShards > 0) {
+        Ns_Log(Error, "dbimy[%s]: writequeue is not supported "
+               "by sharded pools", myCfg->module);
+        return NULL;
+    }
+
+    writer = ns_calloc(1, sizeof(MyWriter));
+    writer->maxQueued   = maxQueued;
+    writer->batchSize   = Ns_ConfigIntRange(path, "writebatch", 100, 1, INT_MAX);
+    writer->flushWait   = Ns_ConfigIntRange(path, "writeflush", 100, 0, INT_MAX);
+    writer->enqueueWait = Ns_ConfigIntRange(path, "writewait",  0,   0, INT_MAX);
+    Ns_MutexInit(&writer->lock);
+    Ns_MutexSetName2(&writer->lock, "dbimy:writer", myCfg->module);
+    Ns_CondInit(&writer->cond);
+    Ns_CondInit(&writer->doneCond);
+    Tcl_InitHashTable(&writer->targets, TCL_STRING_KEYS);
+    Tcl_DStringInit(&writer->sql);
+
+    myCfg->writer = writer;
+    Ns_ThreadCreate(WriterThread, myCfg, 0, &writer->thread);
+    Ns_RegisterAtShutdown(WriterShutdown, myCfg);
+    Ns_RegisterProcInfo(WriterShutdown, "dbimy:writer", NULL);
+
+    return writer;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * WriterThread --
+ *
+ *      Take the queued rows once batchSize have been queued, the
+ *      oldest has waited writeflush ms or a flush was asked for,
+ *      and insert them.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Exits once the queue is empty after WriterShutdown.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+WriterThread(void *arg)
+{
+    MyConfig   *myCfg  = arg;
+    MyWriter   *writer = myCfg->writer;
+    MyWriteRow *rowPtr;
+    Ns_Time     deadline;
+
+    Ns_ThreadSetName("-dbimy:writer:%s-", myCfg->module);
+
+    Ns_MutexLock(&writer->lock);
+    while (writer->firstPtr != NULL || !writer->stop) {
+
+        if (writer->firstPtr == NULL) {
+            Ns_CondWait(&writer->cond, &writer->lock);
+            continue;
+        }
+        if (writer->numQueued < writer->batchSize
+                && writer->flushers == 0 && !writer->stop) {
+            deadline = writer->firstTime;
+            Ns_IncrTime(&deadline, writer->flushWait / 1000,
+                        (writer->flushWait % 1000) * 1000);
+            if (Ns_CondTimedWait(&writer->cond, &writer->lock,
+                                 &deadline) == NS_OK) {
+                continue;
+            }
+        }
+
+        rowPtr = writer->firstPtr;
+        writer->firstPtr = writer->lastPtr = NULL;
+        writer->numWriting = writer->numQueued;
+        writer->numQueued = 0;
+        Ns_CondBroadcast(&writer->doneCond);
+        Ns_MutexUnlock(&writer->lock);
+
+        WriterFlush(myCfg, writer, rowPtr);
+
+        Ns_MutexLock(&writer->lock);
+        writer->numWriting = 0;
+        Ns_CondBroadcast(&writer->doneCond);
+
+        /*
+         * No row refers to an insert prefix any more: free them so
+         * that tables and columns used once don't accumulate.
+         */
+
+        if (writer->firstPtr == NULL) {
+            Tcl_DeleteHashTable(&writer->targets);
+            Tcl_InitHashTable(&writer->targets, TCL_STRING_KEYS);
+        }
+    }
+    writer->stopped = 1;
+    Ns_CondBroadcast(&writer->doneCond);
+    Ns_MutexUnlock(&writer->lock);
+
+    if (writer->conn != NULL) {
+        mysql_close(writer->conn);
+        writer->conn = NULL;
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * WriterFlush --
+ *
+ *      Insert a list of rows taken from the queue. Rows for the same
+ *      table and columns are coalesced, in the order they were
+ *      queued, into multi-row inserts of at most batchSize rows and,
+ *      unless a single row is larger, MY_WRITE_MAX_BYTES. When an
+ *      insert fails for any reason but a lost connection its rows
+ *      are inserted one at a time, so that a bad row fails alone.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Rows are freed. Rows which couldn't be inserted are counted
+ *      as failed and the error is logged.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+WriterFlush(MyConfig *myCfg, MyWriter *writer, MyWriteRow *rowPtr)
+{
+    MyWriteRow  *nextPtr, **prevPtrPtr, *batchPtr, **batchPtrPtr;
+    CONST char  *prefix;
+    Tcl_WideInt  written, failed;
+    int          numRows, length, compressed;
+
+    while (rowPtr != NULL) {
+        written = failed = 0;
+
+        if (writer->conn == NULL) {
+            if (LibraryInit(myCfg) == NS_OK) {
+                InitThread();
+                writer->conn = Connect(NULL, myCfg, myCfg->host, myCfg->port,
+                                       myCfg->unixdomain, &compressed);
+            }
+            if (writer->conn == NULL) {
+                while (rowPtr != NULL) {
+                    nextPtr = rowPtr->nextPtr;
+                    ns_free(rowPtr);
+                    rowPtr = nextPtr;
+                    failed++;
+                }
+                Ns_MutexLock(&writer->lock);
+                writer->failed += failed;
+                Ns_MutexUnlock(&writer->lock);
+                return;
+            }
+        }
+
+        /*
+         * Move the rows of the next insert to the batch list.
+         */
+
+        prefix = rowPtr->prefix;
+        numRows = 0;
+        batchPtr = NULL;
+        batchPtrPtr = &batchPtr;
+        Tcl_DStringSetLength(&writer->sql, 0);
+        Tcl_DStringAppend(&writer->sql, prefix, -1);
+
+        prevPtrPtr = &rowPtr;
+        while (*prevPtrPtr != NULL && numRows < writer->batchSize) {
+            if ((*prevPtrPtr)->prefix != prefix) {
+                prevPtrPtr = &(*prevPtrPtr)->nextPtr;
+                continue;
+            }
+            length = writer->sql.length;
+            if (numRows > 0) {
+                Tcl_DStringAppend(&writer->sql, ",", 1);
+            }
+            WriterAppendRow(writer, *prevPtrPtr);
+            if (numRows > 0 && writer->sql.length > MY_WRITE_MAX_BYTES) {
+                Tcl_DStringSetLength(&writer->sql, length);
+                break;
+            }
+            numRows++;
+
+            nextPtr = (*prevPtrPtr)->nextPtr;
+            *batchPtrPtr = *prevPtrPtr;
+            batchPtrPtr = &(*prevPtrPtr)->nextPtr;
+            *prevPtrPtr = nextPtr;
+        }
+        *batchPtrPtr = NULL;
+
+        if (WriterExec(myCfg, writer) == NS_OK) {
+            written = numRows;
+        } else if (numRows > 1 && writer->conn != NULL
+                   && ErrorClass(mysql_errno(writer->conn)) != MyErrorConnLost) {
+            for (nextPtr = batchPtr; nextPtr != NULL; nextPtr = nextPtr->nextPtr) {
+                if (writer->conn == NULL) {
+                    failed++;
+                    continue;
+                }
+                Tcl_DStringSetLength(&writer->sql, 0);
+                Tcl_DStringAppend(&writer->sql, prefix, -1);
+                WriterAppendRow(writer, nextPtr);
+                if (WriterExec(myCfg, writer) == NS_OK) {
+                    written++;
+                } else {
+                    failed++;
+                }
+            }
+        } else {
+            failed = numRows;
+        }
+
+        while (batchPtr != NULL) {
+            nextPtr = batchPtr->nextPtr;
+            ns_free(batchPtr);
+            batchPtr = nextPtr;
+        }
+
+        Ns_MutexLock(&writer->lock);
+        writer->written += written;
+        writer->failed += failed;
+        writer->batches++;
+        Ns_CondBroadcast(&writer->doneCond);
+        Ns_MutexUnlock(&writer->lock);
+    }
+}
+
+static void
+WriterAppendRow(MyWriter *writer, MyWriteRow *rowPtr)
+{
+    Tcl_DString  *dsPtr = &writer->sql;
+    MyCell       *cellPtr;
+    unsigned int  i;
+    int           length;
+
+    Tcl_DStringAppend(dsPtr, "(", 1);
+    for (i = 0; i < rowPtr->numCols; i++) {
+        cellPtr = &rowPtr->cells[i];
+        if (i > 0) {
+            Tcl_DStringAppend(dsPtr, ",", 1);
+        }
+        if (cellPtr->null) {
+            Tcl_DStringAppend(dsPtr, "NULL", 4);
+            continue;
+        }
+        Tcl_DStringAppend(dsPtr, "'", 1);
+        length = dsPtr->length;
+        Tcl_DStringSetLength(dsPtr, length + (int) cellPtr->length * 2 + 1);
+        length += (int) mysql_real_escape_string(writer->conn,
+                                                 dsPtr->string + length,
+                                                 rowPtr->data + cellPtr->offset,
+                                                 cellPtr->length);
+        Tcl_DStringSetLength(dsPtr, length);
+        Tcl_DStringAppend(dsPtr, "'", 1);
+    }
+    Tcl_DStringAppend(dsPtr, ")", 1);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * WriterExec --
+ *
+ *      Run the insert built by WriterFlush, reconnecting and trying
+ *      once more if the connection was lost. The connection may have
+ *      been lost after the server committed the insert, so delivery
+ *      is at least once: a retried batch may be inserted twice.
+ *
+ * Results:
+ *      NS_OK or NS_ERROR.
+ *
+ * Side effects:
+ *      Errors are logged.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+WriterExec(MyConfig *myCfg, MyWriter *writer)
+{
+    int compressed;
+
+    if (!mysql_real_query(writer->conn, writer->sql.string,
+                          (unsigned long) writer->sql.length)) {
+        return NS_OK;
+    }
+    if (ErrorClass(mysql_errno(writer->conn)) == MyErrorConnLost) {
+        Ns_MutexLock(&myCfg->lock);
+        myCfg->lost++;
+        Ns_MutexUnlock(&myCfg->lock);
+
+        mysql_close(writer->conn);
+        writer->conn = Connect(NULL, myCfg, myCfg->host, myCfg->port,
+                               myCfg->unixdomain, &compressed);
+        if (writer->conn == NULL) {
+            return NS_ERROR;
+        }
+        if (!mysql_real_query(writer->conn, writer->sql.string,
+                              (unsigned long) writer->sql.length)) {
+            return NS_OK;
+        }
+    }
+    Ns_Log(Error, "dbimy[%s]: writer: %s", myCfg->module,
+           mysql_error(writer->conn));
+
+    return NS_ERROR;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * QuoteName --
+ *
+ *      Append a table or column name, which may be qualified by a
+ *      database name, as quoted identifiers.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+QuoteName(Tcl_DString *dsPtr, CONST char *name)
+{
+    CONST char *p;
+
+    Tcl_DStringAppend(dsPtr, "`", 1);
+    for (p = name; *p != '\0'; p++) {
+        if (*p == '`') {
+            Tcl_DStringAppend(dsPtr, "``", 2);
+        } else if (*p == '.') {
+            Tcl_DStringAppend(dsPtr, "`.`", 3);
+        } else {
+            Tcl_DStringAppend(dsPtr, p, 1);
+        }
+    }
+    Tcl_DStringAppend(dsPtr, "`", 1);
+}
+
+static int
+CompareColumns(const void *a, const void *b)
+{
+    return strcmp(Tcl_GetString(*(Tcl_Obj **) a),
+                  Tcl_GetString(*(Tcl_Obj **) b));
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * WriterShutdown --
+ *
+ *      Stop the writer thread once it has written the queued rows,
+ *      waiting until the server shutdown timeout.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Rows enqueued from now on are dropped.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+WriterShutdown(const Ns_Time *toPtr, void *arg)
+{
+    MyConfig *myCfg  = arg;
+    MyWriter *writer = myCfg->writer;
+    int       stopped, numQueued;
+
+    Ns_MutexLock(&writer->lock);
+    if (toPtr == NULL) {
+        writer->stop = 1;
+        Ns_CondBroadcast(&writer->cond);
+        Ns_CondBroadcast(&writer->doneCond);
+        Ns_MutexUnlock(&writer->lock);
+        return;
+    }
+    while (!writer->stopped
+           && Ns_CondTimedWait(&writer->doneCond, &writer->lock,
+                               toPtr) == NS_OK) {
+        ;
+    }
+    stopped = writer->stopped;
+    numQueued = writer->numQueued + writer->numWriting;
+    Ns_MutexUnlock(&writer->lock);
+
+    if (stopped) {
+        Ns_ThreadJoin(&writer->thread, NULL);
+    } else {
+        Ns_Log(Warning, "dbimy[%s]: writer: timeout waiting to write "
+               "%d rows", myCfg->module, numQueued);
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * MyException, MyConnException --
+ *
+ *      Report a MySQL exception for a statement or a connection
+ *      to the dbi layer.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      See SetException.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+MyException(Dbi_Handle *handle, MYSQL_STMT *st)
+{
+    SetException(handle, mysql_stmt_errno(st),
+                 mysql_stmt_sqlstate(st), mysql_stmt_error(st));
+}
+
+static void
+MyConnException(Dbi_Handle *handle, MYSQL *conn)
+{
+    SetException(handle, mysql_errno(conn),
+                 mysql_sqlstate(conn), mysql_error(conn));
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * SetException --
+ *
+ *      Classify a MySQL error and set the dbi exception. Retryable
+ *      errors are reported with sqlstate 40001 and lost connections
+ *      with 08S01, so that callers can tell them apart from errors
+ *      which will fail again no matter how often they're retried.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Fatal exit if memory exhausted. A handle whose connection
+ *      was lost is marked so that Connected() will fail.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+SetException(Dbi_Handle *handle, unsigned int errnum,
+             CONST char *sqlstate, CONST char *msg)
+{
+    MyHandle *myHandle = handle->driverData;
+
+    if (errnum == CR_OUT_OF_MEMORY) {
+        Ns_Fatal("dbimy[%s]: CR_OUT_OF_MEMORY: %s",
+                 Dbi_PoolName(handle->pool), msg);
+    }
+
+    switch (ErrorClass(errnum)) {
+    case MyErrorRetry:
+        sqlstate = MY_SQLSTATE_RETRY;
+        break;
+    case MyErrorConnLost:
+        sqlstate = MY_SQLSTATE_CONNLOST;
+        if (myHandle != NULL && !myHandle->connecting) {
+            ConnLost(myHandle);
+        }
+        break;
+    case MyErrorFatal:
+        break;
+    }
+
+    Dbi_SetException(handle, sqlstate, "%s", msg);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * StartTimer --
+ *
+ *      Note the start of a round trip to the server, if the pool has
+ *      read or write timeouts, so that ConnLost can tell whether a
+ *      lost connection timed out.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+StartTimer(MyHandle *myHandle)
+{
+    MyConfig *myCfg = myHandle->myCfg;
+
+    if (myCfg->readTimeout > 0 || myCfg->writeTimeout > 0) {
+        Ns_GetTime(&myHandle->started);
+    }
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ConnLost --
+ *
+ *      Mark a handle whose connection has gone and count it, and
+ *      whether the last round trip ran into the read or write
+ *      timeout, in the pool stats.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Connected() will fail for the handle.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+ConnLost(MyHandle *myHandle)
+{
+    MyConfig     *myCfg = myHandle->myCfg;
+    unsigned int  timeout;
+
+    if (myHandle->lost) {
+        return;
+    }
+    myHandle->lost = 1;
+
+    timeout = myCfg->readTimeout;
+    if (myCfg->writeTimeout > 0
+            && (timeout == 0 || myCfg->writeTimeout < timeout)) {
+        timeout = myCfg->writeTimeout;
+    }
+
+    Ns_MutexLock(&myCfg->lock);
+    myCfg->lost++;
+    if (TimedOut(&myHandle->started, timeout)) {
+        myCfg->timeouts++;
+    }
+    Ns_MutexUnlock(&myCfg->lock);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ErrorClass --
+ *
+ *      Classify a MySQL client or server error number.
+ *
+ * Results:
+ *      MyErrorRetry, MyErrorConnLost or MyErrorFatal.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static MyErrorClass
+ErrorClass(unsigned int errnum)
+{
+    switch (errnum) {
+
+    case ER_LOCK_DEADLOCK:
+    case ER_LOCK_WAIT_TIMEOUT:
+        return MyErrorRetry;
+
+    case CR_CONNECTION_ERROR:
+    case CR_CONN_HOST_ERROR:
+    case CR_SERVER_GONE_ERROR:
+    case CR_SERVER_LOST:
+#ifdef CR_SERVER_LOST_EXTENDED
+    case CR_SERVER_LOST_EXTENDED:
+#endif
+        return MyErrorConnLost;
+    }
+
+    return MyErrorFatal;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * LibraryInit --
+ *
+ *      Initialise the mysql library, once, before the first
+ *      connection. For an embedded pool the server is started with
+ *      the pool's datadir, buffer pool, table cache and other
+ *      options; those given in a my.cnf [embedded] group still apply.
+ *
+ * Results:
+ *      NS_OK or NS_ERROR if the library (or embedded server) failed
+ *      to initialise.
+ *
+ * Side effects:
+ *      Starts the embedded server if linked with libmysqld.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+LibraryInit(MyConfig *myCfg)
+{
+    static int  initialised = 0, status = NS_OK;
+    Ns_DString  ds;
+    char      **argv = NULL, **extra = NULL;
+    int         argc = 0, numExtra = 0, i;
+
+    Ns_MutexLock(&libraryLock);
+    if (!initialised) {
+        initialised = 1;
+        libraryCfg = myCfg;
+
+        if (myCfg->embed) {
+            if (myCfg->embedArgs != NULL
+                    && Tcl_SplitList(NULL, myCfg->embedArgs,
+                                     &numExtra, (CONST char ***) &extra)
+                       != TCL_OK) {
+                Ns_Log(Warning, "dbimy[%s]: embedargs is not a list: %s",
+                       myCfg->module, myCfg->embedArgs);
+                numExtra = 0;
+            }
+
+            /* Kept for the life of the process, as the server may. */
+            argv = ns_calloc(4 + numExtra + 1, sizeof(char *));
+            argv[argc++] = "nsdbimy";
+            Tcl_DStringInit(&ds);
+            if (myCfg->datadir != NULL) {
+                Ns_DStringPrintf(&ds, "--datadir=%s", myCfg->datadir);
+                argv[argc++] = Ns_DStringExport(&ds);
+            }
+            if (myCfg->bufferPoolSize != NULL) {
+                Ns_DStringPrintf(&ds, "--innodb-buffer-pool-size=%s",
+                                 myCfg->bufferPoolSize);
+                argv[argc++] = Ns_DStringExport(&ds);
+            }
+            if (myCfg->tableOpenCache > 0) {
+                Ns_DStringPrintf(&ds, "--table-open-cache=%d",
+                                 myCfg->tableOpenCache);
+                argv[argc++] = Ns_DStringExport(&ds);
+            }
+            Tcl_DStringFree(&ds);
+            for (i = 0; i < numExtra; i++) {
+                argv[argc++] = extra[i];
+            }
+            for (i = 1; i < argc; i++) {
+                Ns_Log(Notice, "dbimy[%s]: embedded server option %s",
+                       myCfg->module, argv[i]);
+            }
+        }
+
+        if (mysql_library_init(argc, argv, NULL)) {
+            Ns_Log(Error, "dbimy[%s]: mysql library initialisation failed",
+                   myCfg->module);
+            status = NS_ERROR;
+        }
+    }
+    Ns_MutexUnlock(&libraryLock);
+
+    return status;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * InitThread, CleanupThread --
+ *
+ *      Initialise and cleanup msql thread data for each thread
+ *      that calls a mysql_* function.
+ *
+ *      InitThread is called from Open, Prepare and Exec, the 3 functions
+ *      which a thread must call before calling any other dbi functions.
+ *
+ *      CleanupThread is a Tls callback which gets called only when a
+ *      thread exits.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      MySQL memory is freed on thread exit.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+InitThread(void)
+{
+    int initialised;
+
+    initialised = (int) Ns_TlsGet(&tls);
+    if (!initialised) {
+        Ns_TlsSet(&tls, (void *) NS_TRUE);
+        Ns_Log(Debug, "dbimy: InitThread");
+        mysql_thread_init();
+    }
+}
+
+static void
+CleanupThread(void *arg)
+{
+    int initialised = (int) arg;
+
+    if (initialised) {
+        Ns_Log(Debug, "dbimy: CleanupThread");
+        mysql_thread_end();
     }
 }
 
@@ -995,23 +4977,1140 @@ CleanupThread(void *arg)
 /*
  *----------------------------------------------------------------------
  *
- * AtExit --
+ * AtExit --
+ *
+ *      Cleanup the mysql library when the server exits. This is
+ *      important when running the embedded server.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      Embedded mysql may flush data to disk and close tables cleanly.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+AtExit(void *arg)
+{
+    Ns_Log(Debug, "dbimy: AtExit");
+    if (libraryCfg != NULL) {
+        mysql_library_end();
+    }
+}
+
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * InitInterp --
+ *
+ *      Create the dbimy command in a new interp.
+ *
+ * Results:
+ *      TCL_OK.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+InitInterp(Tcl_Interp *interp, void *arg)
+{
+    Tcl_CreateObjCommand(interp, "dbimy", MyObjCmd, NULL, NULL);
+#ifdef DBIMY_SHIM
+    Tcl_CreateObjCommand(interp, "dbimy_shim", DbiMyShimObjCmd, NULL, NULL);
+#endif
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * MyObjCmd --
+ *
+ *      Implements dbimy: MySQL specific extensions to the dbi
+ *      commands. The pool is given with -db, or is the default
+ *      pool of the server.
+ *
+ * Results:
+ *      Standard Tcl result.
+ *
+ * Side effects:
+ *      Depends on subcommand.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+MyObjCmd(ClientData arg, Tcl_Interp *interp, int objc, Tcl_Obj *CONST objv[])
+{
+    MyConfig   *myCfg;
+    CONST char *pool = NULL;
+    int         opt, skip = 2;
+
+    static CONST char *opts[] = {
+        "admission", "cache", "enqueue", "querystats", "retry", "shard",
+        "stats", "writequeue", NULL
+    };
+    enum IOptIdx {
+        IAdmissionIdx, ICacheIdx, IEnqueueIdx, IQueryStatsIdx, IRetryIdx,
+        IShardIdx, IStatsIdx, IWriteQueueIdx
+    };
+
+    if (objc < 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "command ?-db pool? ?args ...?");
+        return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[1], opts, "command", 0,
+                            &opt) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if (objc > 3 && STREQ(Tcl_GetString(objv[2]), "-db")) {
+        pool = Tcl_GetString(objv[3]);
+        skip = 4;
+    }
+    if ((myCfg = GetConfig(interp, pool)) == NULL) {
+        return TCL_ERROR;
+    }
+
+    objc -= skip;
+    objv += skip;
+
+    switch (opt) {
+    case IAdmissionIdx:
+        return AdmissionObjCmd(myCfg, interp, objc, objv);
+    case ICacheIdx:
+        return CacheObjCmd(myCfg, interp, objc, objv);
+    case IEnqueueIdx:
+        return EnqueueObjCmd(myCfg, interp, objc, objv);
+    case IQueryStatsIdx:
+        return QueryStatsObjCmd(myCfg, interp, objc, objv);
+    case IRetryIdx:
+        return RetryObjCmd(myCfg, interp, objc, objv);
+    case IShardIdx:
+        return ShardObjCmd(myCfg, interp, objc, objv);
+    case IStatsIdx:
+        return StatsObjCmd(myCfg, interp, objc, objv);
+    case IWriteQueueIdx:
+        return WriteQueueObjCmd(myCfg, interp, objc, objv);
+    }
+
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * GetConfig --
+ *
+ *      Find the config for the named dbimy pool, or the default
+ *      dbimy pool of the interp's server if pool is NULL.
+ *
+ * Results:
+ *      Pointer to MyConfig or NULL with error left in interp.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static MyConfig *
+GetConfig(Tcl_Interp *interp, CONST char *pool)
+{
+    MyConfig       *myCfg;
+    Tcl_HashEntry  *hPtr;
+    Tcl_HashSearch  search;
+    CONST char     *server;
+
+    if (pool != NULL) {
+        hPtr = Tcl_FindHashEntry(&configs, pool);
+        if (hPtr == NULL) {
+            Tcl_AppendResult(interp, "invalid dbimy pool: ", pool, NULL);
+            return NULL;
+        }
+        return Tcl_GetHashValue(hPtr);
+    }
+
+    server = Ns_TclInterpServer(interp);
+    hPtr = Tcl_FirstHashEntry(&configs, &search);
+    while (hPtr != NULL) {
+        myCfg = Tcl_GetHashValue(hPtr);
+        if (myCfg->isDefault
+                && (myCfg->server == NULL
+                    || (server != NULL && STREQ(myCfg->server, server)))) {
+            return myCfg;
+        }
+        hPtr = Tcl_NextHashEntry(&search);
+    }
+    Tcl_SetResult(interp, "no default dbimy pool", TCL_STATIC);
+
+    return NULL;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * RetryObjCmd --
+ *
+ *      Implements dbimy retry: evaluate a script, usually containing
+ *      a dbi_eval -transaction block, and evaluate it again after a
+ *      randomised exponential backoff if it failed with a retryable
+ *      error such as a deadlock or lock wait timeout.
+ *
+ *      The script must contain the outermost transaction: MySQL
+ *      rolls back the whole transaction on deadlock, so retrying
+ *      a nested block would silently lose the enclosing work.
+ *
+ * Results:
+ *      Result of the last evaluation of the script.
+ *
+ * Side effects:
+ *      Script may be evaluated several times.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+RetryObjCmd(MyConfig *myCfg, Tcl_Interp *interp,
+            int objc, Tcl_Obj *CONST objv[])
+{
+    Tcl_Obj  *scriptObj;
+    Ns_Time   wait;
+    double    backoff;
+    int       attempts, maxWait, ms, n, status;
+
+    Ns_ObjvSpec opts[] = {
+        {"-attempts", Ns_ObjvInt,   &attempts, NULL},
+        {"-wait",     Ns_ObjvInt,   &ms,       NULL},
+        {"-maxwait",  Ns_ObjvInt,   &maxWait,  NULL},
+        {"--",        Ns_ObjvBreak, NULL,      NULL},
+        {NULL, NULL, NULL, NULL}
+    };
+    Ns_ObjvSpec args[] = {
+        {"script",    Ns_ObjvObj,   &scriptObj, NULL},
+        {NULL, NULL, NULL, NULL}
+    };
+
+    attempts = myCfg->retries;
+    ms       = myCfg->retryWait;
+    maxWait  = myCfg->retryMaxWait;
+
+    if (Ns_ParseObjv(opts, args, interp, 0, objc, objv) != NS_OK) {
+        return TCL_ERROR;
+    }
+
+    n = 0;
+    while (1) {
+        status = Tcl_EvalObjEx(interp, scriptObj, 0);
+        if (status != TCL_ERROR
+                || ++n >= attempts
+                || !IsRetryable(interp)) {
+            break;
+        }
+
+        /*
+         * Full jitter: sleep a random time up to the exponential
+         * backoff so that colliding transactions spread out.
+         */
+
+        backoff = (double) ms * (1 << (n > 16 ? 16 : n - 1));
+        if (backoff > maxWait) {
+            backoff = maxWait;
+        }
+        wait.sec  = 0;
+        wait.usec = (long) (Ns_DRand() * backoff * 1000.0);
+        Ns_AdjTime(&wait);
+
+        Ns_Log(Debug, "dbimy[%s]: retry %d/%d after %ld.%06lds: %s",
+               myCfg->module, n, attempts - 1, wait.sec, wait.usec,
+               Tcl_GetStringResult(interp));
+
+        Tcl_ResetResult(interp);
+        Ns_Sleep(&wait);
+    }
+
+    return status;
+}
+
+static int
+IsRetryable(Tcl_Interp *interp)
+{
+    Tcl_Obj  *codeObj, **elemv;
+    int       elemc, i;
+
+    codeObj = Tcl_GetVar2Ex(interp, "errorCode", NULL, TCL_GLOBAL_ONLY);
+    if (codeObj == NULL
+            || Tcl_ListObjGetElements(NULL, codeObj, &elemc, &elemv) != TCL_OK) {
+        return 0;
+    }
+    for (i = 0; i < elemc; i++) {
+        if (STREQ(Tcl_GetString(elemv[i]), MY_SQLSTATE_RETRY)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * CacheObjCmd --
+ *
+ *      Implements dbimy cache: report statistics for, or flush,
+ *      the result cache of a pool.
+ *
+ * Results:
+ *      Standard Tcl result.
+ *
+ * Side effects:
+ *      Depends on subcommand.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+CacheObjCmd(MyConfig *myCfg, Tcl_Interp *interp,
+            int objc, Tcl_Obj *CONST objv[])
+{
+    MyCache  *cache = myCfg->cache;
+    Tcl_Obj  *resObj;
+    int       opt;
+
+    static CONST char *opts[] = {
+        "flush", "stats", NULL
+    };
+    enum IOptIdx {
+        IFlushIdx, IStatsIdx
+    };
+
+    if (objc != 1) {
+        Tcl_WrongNumArgs(interp, 0, objv, "flush|stats");
+        return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[0], opts, "option", 0,
+                            &opt) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if (cache == NULL) {
+        Tcl_AppendResult(interp, "result cache not enabled for pool: ",
+                         myCfg->module, NULL);
+        return TCL_ERROR;
+    }
+
+    Ns_MutexLock(&cache->lock);
+    switch (opt) {
+    case IFlushIdx:
+        while (cache->firstPtr != NULL) {
+            CacheRemove(cache, cache->firstPtr);
+        }
+        break;
+
+    case IStatsIdx:
+        resObj = Tcl_NewListObj(0, NULL);
+        Tcl_ListObjAppendElement(interp, resObj, Tcl_NewStringObj("entries", -1));
+        Tcl_ListObjAppendElement(interp, resObj, Tcl_NewIntObj(cache->entries.numEntries));
+        Tcl_ListObjAppendElement(interp, resObj, Tcl_NewStringObj("size", -1));
+        Tcl_ListObjAppendElement(interp, resObj, Tcl_NewWideIntObj((Tcl_WideInt) cache->size));
+        Tcl_ListObjAppendElement(interp, resObj, Tcl_NewStringObj("maxsize", -1));
+        Tcl_ListObjAppendElement(interp, resObj, Tcl_NewWideIntObj((Tcl_WideInt) cache->maxSize));
+        Tcl_ListObjAppendElement(interp, resObj, Tcl_NewStringObj("hits", -1));
+        Tcl_ListObjAppendElement(interp, resObj, Tcl_NewWideIntObj((Tcl_WideInt) cache->hits));
+        Tcl_ListObjAppendElement(interp, resObj, Tcl_NewStringObj("misses", -1));
+        Tcl_ListObjAppendElement(interp, resObj, Tcl_NewWideIntObj((Tcl_WideInt) cache->misses));
+        Tcl_ListObjAppendElement(interp, resObj, Tcl_NewStringObj("evictions", -1));
+        Tcl_ListObjAppendElement(interp, resObj, Tcl_NewWideIntObj((Tcl_WideInt) cache->evictions));
+        Tcl_ListObjAppendElement(interp, resObj, Tcl_NewStringObj("invalidations", -1));
+        Tcl_ListObjAppendElement(interp, resObj, Tcl_NewWideIntObj((Tcl_WideInt) cache->invalidations));
+        Tcl_SetObjResult(interp, resObj);
+        break;
+    }
+    Ns_MutexUnlock(&cache->lock);
+
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * StatsObjCmd --
+ *
+ *      Implements dbimy stats: return the connection counters of a
+ *      pool as a dict.
+ *
+ * Results:
+ *      Standard Tcl result.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+StatsObjCmd(MyConfig *myCfg, Tcl_Interp *interp,
+            int objc, Tcl_Obj *CONST objv[])
+{
+    Tcl_Obj  *resObj;
+
+    if (objc != 0) {
+        Tcl_WrongNumArgs(interp, 0, objv, "");
+        return TCL_ERROR;
+    }
+
+    resObj = Tcl_NewListObj(0, NULL);
+
+    Ns_MutexLock(&myCfg->lock);
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewStringObj("connects", -1));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewWideIntObj((Tcl_WideInt) myCfg->connects));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewStringObj("connectfailures", -1));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewWideIntObj((Tcl_WideInt) myCfg->connectFailures));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewStringObj("connecttimeouts", -1));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewWideIntObj((Tcl_WideInt) myCfg->connectTimeouts));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewStringObj("timeouts", -1));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewWideIntObj((Tcl_WideInt) myCfg->timeouts));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewStringObj("lost", -1));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewWideIntObj((Tcl_WideInt) myCfg->lost));
+    Ns_MutexUnlock(&myCfg->lock);
+
+    Tcl_SetObjResult(interp, resObj);
+
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * QueryStatsObjCmd --
  *
- *      Cleanup the mysql library when the server exits. This is
- *      important when running the embedded server.
+ *      Implements dbimy querystats: return a dict of the stats of
+ *      each statement run through a pool, keyed by SQL, or reset
+ *      them.
+ *
+ * Results:
+ *      Standard Tcl result.
+ *
+ * Side effects:
+ *      reset frees the stats. Statements find their entry again
+ *      when they next complete.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+QueryStatsObjCmd(MyConfig *myCfg, Tcl_Interp *interp,
+                 int objc, Tcl_Obj *CONST objv[])
+{
+    MyQueryStats   *stats;
+    Tcl_HashEntry  *hPtr;
+    Tcl_HashSearch  search;
+    Tcl_Obj        *resObj, *statsObj;
+    int             reset = 0;
+
+    if (objc == 1 && STREQ(Tcl_GetString(objv[0]), "reset")) {
+        reset = 1;
+    } else if (objc != 0) {
+        Tcl_WrongNumArgs(interp, 0, objv, "?reset?");
+        return TCL_ERROR;
+    }
+
+    resObj = Tcl_NewListObj(0, NULL);
+
+    Ns_MutexLock(&myCfg->lock);
+    hPtr = Tcl_FirstHashEntry(&myCfg->queryStats, &search);
+    while (hPtr != NULL) {
+        stats = Tcl_GetHashValue(hPtr);
+        if (reset) {
+            ns_free(stats);
+        } else if (stats->count > 0) {
+            statsObj = Tcl_NewListObj(0, NULL);
+            Tcl_ListObjAppendElement(interp, statsObj, Tcl_NewStringObj("count", -1));
+            Tcl_ListObjAppendElement(interp, statsObj, Tcl_NewWideIntObj(stats->count));
+            Tcl_ListObjAppendElement(interp, statsObj, Tcl_NewStringObj("errors", -1));
+            Tcl_ListObjAppendElement(interp, statsObj, Tcl_NewWideIntObj(stats->errors));
+            Tcl_ListObjAppendElement(interp, statsObj, Tcl_NewStringObj("usec", -1));
+            Tcl_ListObjAppendElement(interp, statsObj, Tcl_NewWideIntObj(stats->usec));
+            Tcl_ListObjAppendElement(interp, statsObj, Tcl_NewStringObj("maxusec", -1));
+            Tcl_ListObjAppendElement(interp, statsObj, Tcl_NewWideIntObj(stats->maxUsec));
+            Tcl_ListObjAppendElement(interp, statsObj, Tcl_NewStringObj("rows", -1));
+            Tcl_ListObjAppendElement(interp, statsObj, Tcl_NewWideIntObj(stats->rows));
+            Tcl_ListObjAppendElement(interp, statsObj, Tcl_NewStringObj("affected", -1));
+            Tcl_ListObjAppendElement(interp, statsObj, Tcl_NewWideIntObj(stats->affected));
+            Tcl_ListObjAppendElement(interp, statsObj, Tcl_NewStringObj("insertid", -1));
+            Tcl_ListObjAppendElement(interp, statsObj, Tcl_NewWideIntObj(stats->insertId));
+            Tcl_ListObjAppendElement(interp, statsObj, Tcl_NewStringObj("warnings", -1));
+            Tcl_ListObjAppendElement(interp, statsObj, Tcl_NewWideIntObj(stats->warnings));
+            Tcl_ListObjAppendElement(interp, statsObj, Tcl_NewStringObj("noindex", -1));
+            Tcl_ListObjAppendElement(interp, statsObj, Tcl_NewWideIntObj(stats->noIndex));
+            Tcl_ListObjAppendElement(interp, statsObj, Tcl_NewStringObj("nogoodindex", -1));
+            Tcl_ListObjAppendElement(interp, statsObj, Tcl_NewWideIntObj(stats->noGoodIndex));
+            Tcl_ListObjAppendElement(interp, statsObj, Tcl_NewStringObj("slow", -1));
+            Tcl_ListObjAppendElement(interp, statsObj, Tcl_NewWideIntObj(stats->slow));
+
+            Tcl_ListObjAppendElement(interp, resObj,
+                Tcl_NewStringObj(Tcl_GetHashKey(&myCfg->queryStats, hPtr), -1));
+            Tcl_ListObjAppendElement(interp, resObj, statsObj);
+        }
+        hPtr = Tcl_NextHashEntry(&search);
+    }
+    if (reset) {
+        Tcl_DeleteHashTable(&myCfg->queryStats);
+        Tcl_InitHashTable(&myCfg->queryStats, TCL_STRING_KEYS);
+        myCfg->queryStatsGeneration++;
+    }
+    Ns_MutexUnlock(&myCfg->lock);
+
+    Tcl_SetObjResult(interp, resObj);
+
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * QueryStatsGet --
+ *
+ *      Find or create the stats of a statement. Once querystats
+ *      statements are known, the stats of any other go to the entry
+ *      "(other)". Called with the pool locked.
+ *
+ * Results:
+ *      Pointer to MyQueryStats.
+ *
+ * Side effects:
+ *      Entries live until the next reset.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static MyQueryStats *
+QueryStatsGet(MyConfig *myCfg, CONST char *sql)
+{
+    Tcl_HashEntry *hPtr;
+    int            new;
+
+    hPtr = Tcl_FindHashEntry(&myCfg->queryStats, sql);
+    if (hPtr == NULL) {
+        if (myCfg->queryStats.numEntries >= myCfg->maxQueryStats) {
+            sql = "(other)";
+        }
+        hPtr = Tcl_CreateHashEntry(&myCfg->queryStats, sql, &new);
+        if (new) {
+            Tcl_SetHashValue(hPtr, ns_calloc(1, sizeof(MyQueryStats)));
+        }
+    }
+
+    return Tcl_GetHashValue(hPtr);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * QueryStatsBegin, QueryStatsEnd --
+ *
+ *      Time an execution and add it to the stats of its statement
+ *      when it fails, when DML completes or when the last row of a
+ *      query has been fetched or flushed. Affected rows, insert id,
+ *      warnings and the index used flags are those the server sent
+ *      with the OK or EOF packet, so no extra round trip is made.
  *
  * Results:
  *      None.
  *
  * Side effects:
- *      Embedded mysql may flush data to disk and close tables cleanly.
+ *      None.
  *
  *----------------------------------------------------------------------
  */
 
 static void
-AtExit(void *arg)
+QueryStatsBegin(MyStatement *myStmt)
 {
-    Ns_Log(Debug, "dbimy: AtExit");
-    mysql_library_end();
+    if (myStmt->statsSql != NULL) {
+        Ns_GetTime(&myStmt->started);
+        myStmt->timing  = 1;
+        myStmt->numRows = 0;
+    }
+}
+
+static void
+QueryStatsEnd(MyHandle *myHandle, MyStatement *myStmt, int error)
+{
+    MyConfig     *myCfg = myHandle->myCfg;
+    MyQueryStats *stats;
+    Ns_Time       now, diff;
+    Tcl_WideInt   usec, affected = 0, insertId = 0;
+    unsigned int  status = 0, warnings = 0;
+
+    if (!myStmt->timing) {
+        return;
+    }
+    myStmt->timing = 0;
+
+    Ns_GetTime(&now);
+    Ns_DiffTime(&now, &myStmt->started, &diff);
+    usec = (Tcl_WideInt) diff.sec * 1000000 + diff.usec;
+
+    if (!error) {
+        status   = myHandle->conn->server_status;
+        warnings = mysql_warning_count(myHandle->conn);
+        insertId = (Tcl_WideInt) mysql_stmt_insert_id(myStmt->st);
+        if (myStmt->numCols == 0) {
+            affected = (Tcl_WideInt) mysql_stmt_affected_rows(myStmt->st);
+        }
+    }
+
+    Ns_MutexLock(&myCfg->lock);
+    if (myStmt->stats == NULL
+            || myStmt->statsGeneration != myCfg->queryStatsGeneration) {
+        myStmt->stats = QueryStatsGet(myCfg, myStmt->statsSql);
+        myStmt->statsGeneration = myCfg->queryStatsGeneration;
+    }
+    stats = myStmt->stats;
+    stats->count++;
+    stats->errors += error;
+    stats->usec += usec;
+    if (usec > stats->maxUsec) {
+        stats->maxUsec = usec;
+    }
+    stats->rows += myStmt->numRows;
+    stats->affected += affected;
+    if (insertId > 0) {
+        stats->insertId = insertId;
+    }
+    stats->warnings += warnings;
+    if (status & SERVER_QUERY_NO_INDEX_USED) {
+        stats->noIndex++;
+    }
+    if (status & SERVER_QUERY_NO_GOOD_INDEX_USED) {
+        stats->noGoodIndex++;
+    }
+    if (status & SERVER_QUERY_WAS_SLOW) {
+        stats->slow++;
+    }
+    Ns_MutexUnlock(&myCfg->lock);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * AdmissionObjCmd --
+ *
+ *      Implements dbimy admission: return a dict of the limits,
+ *      the reads and writes running and queued, and the number and
+ *      wait time of those admitted, timed out or shed.
+ *
+ * Results:
+ *      Standard Tcl result.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+AdmissionObjCmd(MyConfig *myCfg, Tcl_Interp *interp,
+                int objc, Tcl_Obj *CONST objv[])
+{
+    Tcl_Obj *resObj;
+
+    if (objc != 0) {
+        Tcl_WrongNumArgs(interp, 0, objv, "");
+        return TCL_ERROR;
+    }
+
+    resObj = Tcl_NewListObj(0, NULL);
+
+    Ns_MutexLock(&myCfg->admitLock);
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewStringObj("maxreads", -1));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewIntObj(myCfg->maxRunning[0]));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewStringObj("maxwrites", -1));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewIntObj(myCfg->maxRunning[1]));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewStringObj("reads", -1));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewIntObj(myCfg->running[0]));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewStringObj("writes", -1));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewIntObj(myCfg->running[1]));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewStringObj("waitingreads", -1));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewIntObj(myCfg->waiting[0]));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewStringObj("waitingwrites", -1));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewIntObj(myCfg->waiting[1]));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewStringObj("admitted", -1));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewWideIntObj(myCfg->admitted));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewStringObj("queued", -1));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewWideIntObj(myCfg->queued));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewStringObj("timeouts", -1));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewWideIntObj(myCfg->admitTimeouts));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewStringObj("shed", -1));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewWideIntObj(myCfg->shed));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewStringObj("waitusec", -1));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewWideIntObj(myCfg->waitUsec));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewStringObj("maxwaitusec", -1));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewWideIntObj(myCfg->maxWaitUsec));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewStringObj("latencyusec", -1));
+    Tcl_ListObjAppendElement(interp, resObj,
+                             Tcl_NewWideIntObj((Tcl_WideInt) myCfg->avgLatency));
+    Ns_MutexUnlock(&myCfg->admitLock);
+
+    Tcl_SetObjResult(interp, resObj);
+
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Admit --
+ *
+ *      Wait for a slot to run a read or a write when the pool caps
+ *      them. When no slot is free and the average execute time is
+ *      above latencytarget the statement is refused at once, as
+ *      queueing would only make it worse. Otherwise it waits at most
+ *      admitwait ms for a running statement of its kind to finish.
+ *
+ * Results:
+ *      NS_OK, or NS_ERROR with exception HYT00 when shed or timed out.
+ *
+ * Side effects:
+ *      Takes a slot to be given back by AdmitRelease. Sets the time
+ *      the statement started to run.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+Admit(Dbi_Handle *handle, MyConfig *myCfg, int write, Ns_Time *startedPtr)
+{
+    Ns_Time     now, deadline, diff;
+    Tcl_WideInt usec;
+    int         status = NS_OK, queued = 0;
+
+    if (!myCfg->admission || myCfg->maxRunning[write] == 0) {
+        return NS_OK;
+    }
+
+    Ns_GetTime(startedPtr);
+    deadline = *startedPtr;
+    Ns_IncrTime(&deadline, myCfg->admitWait / 1000,
+                (myCfg->admitWait % 1000) * 1000);
+
+    Ns_MutexLock(&myCfg->admitLock);
+    if (myCfg->running[write] >= myCfg->maxRunning[write]
+            && myCfg->latencyTarget > 0
+            && myCfg->avgLatency > myCfg->latencyTarget * 1000.0) {
+        myCfg->shed++;
+        Ns_MutexUnlock(&myCfg->admitLock);
+        Dbi_SetException(handle, "HYT00",
+                         "dbimy: %s shed, average latency %d ms is above %d ms",
+                         write ? "write" : "read",
+                         (int) (myCfg->avgLatency / 1000),
+                         myCfg->latencyTarget);
+        return NS_ERROR;
+    }
+    myCfg->waiting[write]++;
+    while (status == NS_OK
+           && myCfg->running[write] >= myCfg->maxRunning[write]) {
+        queued = 1;
+        status = Ns_CondTimedWait(&myCfg->admitCond[write],
+                                  &myCfg->admitLock, &deadline);
+    }
+    myCfg->waiting[write]--;
+
+    /*
+     * A slot freed as the wait timed out is still taken.
+     */
+
+    if (myCfg->running[write] < myCfg->maxRunning[write]) {
+        status = NS_OK;
+    }
+    Ns_GetTime(&now);
+    Ns_DiffTime(&now, startedPtr, &diff);
+    usec = (Tcl_WideInt) diff.sec * 1000000 + diff.usec;
+
+    if (status == NS_OK) {
+        myCfg->running[write]++;
+        myCfg->admitted++;
+        if (queued) {
+            myCfg->queued++;
+            myCfg->waitUsec += usec;
+            if (usec > myCfg->maxWaitUsec) {
+                myCfg->maxWaitUsec = usec;
+            }
+        }
+    } else {
+        myCfg->admitTimeouts++;
+        myCfg->waitUsec += usec;
+    }
+    Ns_MutexUnlock(&myCfg->admitLock);
+
+    if (status != NS_OK) {
+        Dbi_SetException(handle, "HYT00",
+                         "dbimy: timed out after %d ms waiting to run a %s",
+                         myCfg->admitWait, write ? "write" : "read");
+        return NS_ERROR;
+    }
+    *startedPtr = now;
+
+    return NS_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * AdmitRelease --
+ *
+ *      Give back the slot taken by Admit, wake the next statement
+ *      waiting for it and fold the execute time into the average.
+ *
+ * Results:
+ *      None.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static void
+AdmitRelease(MyConfig *myCfg, int write, Ns_Time *startedPtr)
+{
+    Ns_Time     now, diff;
+    Tcl_WideInt usec;
+
+    if (!myCfg->admission || myCfg->maxRunning[write] == 0) {
+        return;
+    }
+
+    Ns_GetTime(&now);
+    Ns_DiffTime(&now, startedPtr, &diff);
+    usec = (Tcl_WideInt) diff.sec * 1000000 + diff.usec;
+
+    Ns_MutexLock(&myCfg->admitLock);
+    myCfg->running[write]--;
+    myCfg->avgLatency += (usec - myCfg->avgLatency) / 8;
+    Ns_CondSignal(&myCfg->admitCond[write]);
+    Ns_MutexUnlock(&myCfg->admitLock);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * EnqueueObjCmd --
+ *
+ *      Implements dbimy enqueue: queue a row, a dict of column names
+ *      and values, to be inserted into a table by the background
+ *      writer. Values equal to the -null string are inserted as
+ *      NULL. When the queue is full the caller waits at most
+ *      writewait ms for the writer to catch up.
+ *
+ * Results:
+ *      Standard Tcl result: 1 if the row was queued, 0 if dropped.
+ *
+ * Side effects:
+ *      May wake the writer thread.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+EnqueueObjCmd(MyConfig *myCfg, Tcl_Interp *interp,
+              int objc, Tcl_Obj *CONST objv[])
+{
+    MyWriter       *writer = myCfg->writer;
+    MyWriteRow     *rowPtr;
+    Tcl_Obj        *rowObj, **elemv, **pairv;
+    Tcl_DString     ds;
+    Tcl_HashEntry  *hPtr;
+    Ns_Time         deadline;
+    CONST char     *table, *value, *null = NULL;
+    MyCell         *cellPtr;
+    size_t          size;
+    int             elemc, i, length, new, queued = 0;
+
+    Ns_ObjvSpec opts[] = {
+        {"-null",  Ns_ObjvString, &null,   NULL},
+        {"--",     Ns_ObjvBreak,  NULL,    NULL},
+        {NULL, NULL, NULL, NULL}
+    };
+    Ns_ObjvSpec args[] = {
+        {"table",  Ns_ObjvString, &table,  NULL},
+        {"row",    Ns_ObjvObj,    &rowObj, NULL},
+        {NULL, NULL, NULL, NULL}
+    };
+
+    if (Ns_ParseObjv(opts, args, interp, 0, objc, objv) != NS_OK) {
+        return TCL_ERROR;
+    }
+    if (writer == NULL) {
+        Tcl_AppendResult(interp, "background writer not enabled for pool: ",
+                         myCfg->module, NULL);
+        return TCL_ERROR;
+    }
+    if (Tcl_ListObjGetElements(interp, rowObj, &elemc, &elemv) != TCL_OK) {
+        return TCL_ERROR;
+    }
+    if (elemc == 0 || elemc % 2 != 0) {
+        Tcl_SetResult(interp, "row must be a dict of column names and values",
+                      TCL_STATIC);
+        return TCL_ERROR;
+    }
+
+    /*
+     * Sort the columns by name so that rows for the same columns,
+     * in whatever order, share an insert prefix and a batch.
+     */
+
+    pairv = ns_malloc(elemc * sizeof(Tcl_Obj *));
+    memcpy(pairv, elemv, elemc * sizeof(Tcl_Obj *));
+    qsort(pairv, elemc / 2, 2 * sizeof(Tcl_Obj *), CompareColumns);
+
+    /*
+     * Copy the values now: the writer thread can't use Tcl objects.
+     */
+
+    size = sizeof(MyWriteRow) + (elemc / 2) * sizeof(MyCell);
+    for (i = 1; i < elemc; i += 2) {
+        (void) Tcl_GetStringFromObj(pairv[i], &length);
+        size += (size_t) length;
+    }
+    rowPtr = ns_malloc(size);
+    rowPtr->nextPtr = NULL;
+    rowPtr->numCols = (unsigned int) elemc / 2;
+    rowPtr->cells   = (MyCell *) (rowPtr + 1);
+    rowPtr->data    = (char *) (rowPtr->cells + rowPtr->numCols);
+
+    Tcl_DStringInit(&ds);
+    Tcl_DStringAppend(&ds, "insert into ", -1);
+    QuoteName(&ds, table);
+    Tcl_DStringAppend(&ds, " (", 2);
+    size = 0;
+    for (i = 0; i < elemc; i += 2) {
+        if (i > 0) {
+            Tcl_DStringAppend(&ds, ",", 1);
+        }
+        QuoteName(&ds, Tcl_GetString(pairv[i]));
+
+        value = Tcl_GetStringFromObj(pairv[i + 1], &length);
+        cellPtr = &rowPtr->cells[i / 2];
+        cellPtr->offset = size;
+        if (null != NULL && STREQ(value, null)) {
+            cellPtr->length = 0;
+            cellPtr->null   = 1;
+            continue;
+        }
+        cellPtr->length = (size_t) length;
+        cellPtr->null   = 0;
+        memcpy(rowPtr->data + size, value, (size_t) length);
+        size += (size_t) length;
+    }
+    Tcl_DStringAppend(&ds, ") values ", -1);
+    ns_free(pairv);
+
+    Ns_MutexLock(&writer->lock);
+    if (writer->numQueued >= writer->maxQueued
+            && writer->enqueueWait > 0 && !writer->stop) {
+        Ns_GetTime(&deadline);
+        Ns_IncrTime(&deadline, writer->enqueueWait / 1000,
+                    (writer->enqueueWait % 1000) * 1000);
+        while (writer->numQueued >= writer->maxQueued && !writer->stop
+               && Ns_CondTimedWait(&writer->doneCond, &writer->lock,
+                                   &deadline) == NS_OK) {
+            ;
+        }
+    }
+    if (writer->numQueued < writer->maxQueued && !writer->stop) {
+        hPtr = Tcl_CreateHashEntry(&writer->targets, ds.string, &new);
+        rowPtr->prefix = Tcl_GetHashKey(&writer->targets, hPtr);
+        if (writer->lastPtr == NULL) {
+            writer->firstPtr = rowPtr;
+            Ns_GetTime(&writer->firstTime);
+            Ns_CondSignal(&writer->cond);
+        } else {
+            writer->lastPtr->nextPtr = rowPtr;
+        }
+        writer->lastPtr = rowPtr;
+        if (++writer->numQueued == writer->batchSize) {
+            Ns_CondSignal(&writer->cond);
+        }
+        writer->enqueued++;
+        queued = 1;
+    } else {
+        writer->dropped++;
+    }
+    Ns_MutexUnlock(&writer->lock);
+
+    Tcl_DStringFree(&ds);
+    if (!queued) {
+        ns_free(rowPtr);
+    }
+    Tcl_SetObjResult(interp, Tcl_NewBooleanObj(queued));
+
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * WriteQueueObjCmd --
+ *
+ *      Implements dbimy writequeue: return a dict of the background
+ *      writer counters or, with flush, wait until every row queued
+ *      before the call has been written or has failed. Rows queued
+ *      meanwhile by other threads don't hold it up.
+ *
+ * Results:
+ *      Standard Tcl result, an error if flush waited longer than
+ *      -timeout ms.
+ *
+ * Side effects:
+ *      flush wakes the writer thread.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+WriteQueueObjCmd(MyConfig *myCfg, Tcl_Interp *interp,
+                 int objc, Tcl_Obj *CONST objv[])
+{
+    MyWriter    *writer = myCfg->writer;
+    Tcl_Obj     *resObj;
+    Tcl_WideInt  target;
+    Ns_Time      deadline;
+    int          timeout = MY_WRITE_FLUSH_TIMEOUT, done;
+
+    Ns_ObjvSpec opts[] = {
+        {"-timeout", Ns_ObjvInt, &timeout, NULL},
+        {NULL, NULL, NULL, NULL}
+    };
+
+    if (objc > 0 && !STREQ(Tcl_GetString(objv[0]), "flush")) {
+        Tcl_WrongNumArgs(interp, 0, objv, "?flush ?-timeout ms??");
+        return TCL_ERROR;
+    }
+    if (objc > 0
+            && Ns_ParseObjv(opts, NULL, interp, 1, objc, objv) != NS_OK) {
+        return TCL_ERROR;
+    }
+    if (writer == NULL) {
+        Tcl_AppendResult(interp, "background writer not enabled for pool: ",
+                         myCfg->module, NULL);
+        return TCL_ERROR;
+    }
+
+    Ns_MutexLock(&writer->lock);
+    if (objc > 0) {
+        Ns_GetTime(&deadline);
+        Ns_IncrTime(&deadline, timeout / 1000, (timeout % 1000) * 1000);
+        target = writer->enqueued;
+        writer->flushers++;
+        Ns_CondSignal(&writer->cond);
+        while (writer->written + writer->failed < target
+               && !writer->stopped
+               && Ns_CondTimedWait(&writer->doneCond, &writer->lock,
+                                   &deadline) == NS_OK) {
+            ;
+        }
+        done = writer->written + writer->failed >= target || writer->stopped;
+        writer->flushers--;
+        Ns_MutexUnlock(&writer->lock);
+        if (!done) {
+            Tcl_SetErrorCode(interp, "NS_TIMEOUT", NULL);
+            Tcl_SetResult(interp, "timeout waiting for the write queue "
+                          "to flush", TCL_STATIC);
+            return TCL_ERROR;
+        }
+        return TCL_OK;
+    }
+
+    resObj = Tcl_NewListObj(0, NULL);
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewStringObj("maxqueued", -1));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewIntObj(writer->maxQueued));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewStringObj("queued", -1));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewIntObj(writer->numQueued));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewStringObj("writing", -1));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewIntObj(writer->numWriting));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewStringObj("enqueued", -1));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewWideIntObj(writer->enqueued));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewStringObj("dropped", -1));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewWideIntObj(writer->dropped));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewStringObj("written", -1));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewWideIntObj(writer->written));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewStringObj("failed", -1));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewWideIntObj(writer->failed));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewStringObj("batches", -1));
+    Tcl_ListObjAppendElement(interp, resObj, Tcl_NewWideIntObj(writer->batches));
+    Ns_MutexUnlock(&writer->lock);
+
+    Tcl_SetObjResult(interp, resObj);
+
+    return TCL_OK;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * ShardObjCmd --
+ *
+ *      Implements dbimy shard: return the name of the shard a key
+ *      value is routed to.
+ *
+ * Results:
+ *      Standard Tcl result.
+ *
+ * Side effects:
+ *      None.
+ *
+ *----------------------------------------------------------------------
+ */
+
+static int
+ShardObjCmd(MyConfig *myCfg, Tcl_Interp *interp,
+            int objc, Tcl_Obj *CONST objv[])
+{
+    Dbi_Value   value;
+    CONST char *sqlstate, *msg;
+    int         length, shard;
+
+    if (objc != 1) {
+        Tcl_WrongNumArgs(interp, 0, objv, "key");
+        return TCL_ERROR;
+    }
+    if (myCfg->numShards == 0) {
+        Tcl_AppendResult(interp, "not a sharded pool: ",
+                         myCfg->module, NULL);
+        return TCL_ERROR;
+    }
+
+    value.data   = Tcl_GetStringFromObj(objv[0], &length);
+    value.length = (size_t) length;
+    value.binary = 0;
+
+    if ((shard = ShardOf(myCfg, &value, &sqlstate, &msg)) < 0) {
+        Tcl_AppendResult(interp, "shard key ", Tcl_GetString(objv[0]),
+                         " ", msg, NULL);
+        Tcl_SetErrorCode(interp, "NSDBI", sqlstate, NULL);
+        return TCL_ERROR;
+    }
+    Tcl_SetObjResult(interp, Tcl_NewStringObj(myCfg->shards[shard].name, -1));
+
+    return TCL_OK;
 }
@@ -1,15 +1,51 @@
 #
 # nsdbimy configuration example.
 #
-#     The nsdbimy MySQL database driver accepts 6
+#     The nsdbimy MySQL database driver accepts the following
 #     extra configuration parameters:
 #
-#     database:    (default "mysql")
-#     user:       (default "root")
-#     password:   (default blank)
-#     host:       (mysql default)
-#     port:       (mysql default)
-#     unixdomain: (mysql default)
+#     database:     (default "mysql")
+#     user:         (default "root")
+#     password:     (default blank)
+#     host:         (mysql default)
+#     port:         (mysql default)
+#     unixdomain:   (mysql default)
+#     embed:        (default false)
+#     datadir:      (my.cnf default) embedded server data directory
+#     bufferpoolsize: (server default) embedded InnoDB buffer pool, e.g. 256M
+#     tableopencache: (server default) embedded server open tables
+#     embedargs:    (default none) list of other embedded server options
+#     retries:      (default 3) attempts made by dbimy retry
+#     retrywait:    (default 50) base retry backoff in ms
+#     retrymaxwait: (default 2000) max single retry backoff in ms
+#     cachesize:    (default 0) bytes of result cache, 0 disables
+#     cachettl:     (default 60) seconds a cached result is valid
+#     cachetables:  (default none) tables whose writes flush the cache
+#     compress:     (default off) protocol compression: off, on, adaptive
+#     compressalgorithms: (mysql default) e.g. "zstd,zlib", MySQL 8.0.18+
+#     zstdlevel:    (default 3) zstd compression level
+#     compressminbytes: (default 65536) adaptive: average result size
+#     compressminrtt:   (default 2000) adaptive: round trip in usec
+#     connecttimeout:   (default 10) seconds to connect, 0 no limit
+#     readtimeout:  (default 0) seconds per read attempt (3 tries), 0 none
+#     writetimeout: (default 0) seconds per write attempt (2 tries), 0 none
+#     keepalive:    (default true) TCP keepalive
+#     keepidle:     (default 60) seconds idle before keepalive probes
+#     keepintvl:    (default 10) seconds between keepalive probes
+#     keepcnt:      (default 6) failed probes before connection is dropped
+#     shardkey:     (default none) bind variable to route a sharded pool by
+#     shardmap:     (default hash) shard map: hash, range
+#     scatterthreads: (default shards - 1) workers for scatter queries
+#     querystats:   (default 1000) statements with dbimy querystats, 0 disables
+#     maxreads:     (default 0) queries run at once, 0 no limit
+#     maxwrites:    (default 0) DML run at once, 0 no limit
+#     admitwait:    (default 1000) max ms a statement waits to run
+#     latencytarget: (default 0) ms average execute time above which
+#                   statements are refused rather than queued, 0 off
+#     writequeue:   (default 0) rows dbimy enqueue may queue, 0 disables
+#     writebatch:   (default 100) rows per insert of the background writer
+#     writeflush:   (default 100) max ms a queued row waits for a batch
+#     writewait:    (default 0) ms dbimy enqueue waits on a full queue
 #
 
 
@@ -52,3 +88,62 @@ ns_param   user           "root"
 #ns_param   host           localhost
 #ns_param   port           3306
 #ns_param   unixdomain     /var/lib/mysql/mysql.sock
+#
+# Retry deadlocked transactions wrapped in dbimy retry.
+#
+#ns_param   retries        3
+#ns_param   retrywait      50
+#ns_param   retrymaxwait   2000
+#
+# Cache the results of queries marked /* dbimy:cache */.
+#
+#ns_param   cachesize      [expr {10 * 1024 * 1024}]
+#ns_param   cachettl       60
+#ns_param   cachetables    {country feature_flag}
+#
+# Compress the protocol when results are large and the link is slow.
+# Set maxopen or maxqueries so handles are replaced as the
+# workload changes.
+#
+#ns_param   compress            adaptive
+#ns_param   compressalgorithms  "zstd,zlib"
+#ns_param   compressminbytes    65536
+#ns_param   compressminrtt      2000
+#
+# Fail fast when the server is unreachable or stops responding.
+#
+#ns_param   connecttimeout  5
+#ns_param   readtimeout     30
+#ns_param   writetimeout    30
+#ns_param   keepidle        60
+
+
+#
+# A sharded pool: the hosts of each shard are in its shards section.
+#
+#ns_section "ns/server/server1/modules"
+#ns_param   users          $bindir/nsdbimy.so
+#
+#ns_section "ns/server/server1/module/users"
+#ns_param   shardkey       user_id
+#ns_param   shardmap       hash
+#
+#ns_section "ns/server/server1/module/users/shards"
+#ns_param   s1             "db1a:3306 db1b:3306"
+#ns_param   s2             "db2a:3306 db2b:3306"
+
+
+#
+# An embedded server pool with one handle per thread. The server
+# options are taken from the first embedded pool loaded.
+#
+#ns_section "ns/server/server1/modules"
+#ns_param   local          $bindir/nsdbimy.so
+#
+#ns_section "ns/server/server1/module/local"
+#ns_param   embed          true
+#ns_param   maxhandles     0
+#ns_param   datadir        /srv/example.com/data
+#ns_param   bufferpoolsize 256M
+#ns_param   tableopencache 2000
+#ns_param   embedargs      {--innodb-flush-log-at-trx-commit=2}
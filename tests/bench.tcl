@@ -0,0 +1,323 @@
+#
+# The contents of this file are subject to the Mozilla Public License
+# Version 1.1 (the "License"); you may not use this file except in
+# compliance with the License. You may obtain a copy of the License at
+# http://mozilla.org/
+#
+# Software distributed under the License is distributed on an "AS IS"
+# basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See
+# the License for the specific language governing rights and limitations
+# under the License.
+#
+# Copyright (C) 2006 Stephen Deasey <sdeasey@gmail.com>
+#
+# Alternatively, the contents of this file may be used under the terms
+# of the GNU General Public License (the "GPL"), in which case the
+# provisions of GPL are applicable instead of those above.  If you wish
+# to allow use of your version of this file only under the terms of the
+# GPL and not to allow others to use your version of this file under the
+# License, indicate your decision by deleting the provisions above and
+# replace them with the notice and other provisions required by the GPL.
+# If you do not delete the provisions above, a recipient may use your
+# version of this file under either the License or the GPL.
+#
+
+
+#
+# bench.tcl --
+#
+#       Benchmarks for the driver hot path: prepare, exec, row fetch,
+#       BLOBs, transactions, queued writes and multi-thread scaling.
+#       Run it with "make bench", with mysqld on DBIMY_SOCKET or the
+#       embedded server if DBIMY_EMBED=1.
+#
+#       Results are written one JSON object per line to the file
+#       named by DBIMY_BENCH_OUTPUT, default bench_output.txt.
+#
+#       DBIMY_BENCH_SCALE multiplies the iteration counts, e.g. 0.1
+#       for a quick smoke run.
+#
+
+
+set pool   bench4
+set scale  [ns_env get -nocomplain DBIMY_BENCH_SCALE]
+set output [ns_env get -nocomplain DBIMY_BENCH_OUTPUT]
+
+if {$scale eq ""} {
+    set scale 1
+}
+if {$output eq ""} {
+    set output bench_output.txt
+}
+
+set out [open $output w]
+
+
+#
+# Record a result: elapsed microseconds for n operations of some unit.
+#
+
+proc result {name n usec unit {extra {}}} {
+    global out pool
+
+    set secs [expr {$usec / 1000000.0}]
+    set rate [expr {$secs > 0 ? $n / $secs : 0}]
+
+    set json [format {"name":"%s","pool":"%s","n":%d,"seconds":%.6f,"rate":%.1f,"unit":"%s"} \
+                  $name $pool $n $secs $rate $unit]
+    foreach {k v} $extra {
+        append json [format {,"%s":%s} $k $v]
+    }
+    set json "{$json}"
+
+    puts $out $json
+    flush $out
+    ns_log notice "bench: $json"
+}
+
+proc iterations {n} {
+    global scale
+    expr {max(1, int($n * $scale))}
+}
+
+proc elapsed {script} {
+    set start [clock microseconds]
+    uplevel 1 $script
+    expr {[clock microseconds] - $start}
+}
+
+
+puts $out [format {{"name":"info","embed":%s,"tcl":"%s","time":%d}} \
+               [expr {[ns_env get -nocomplain DBIMY_EMBED] eq "1"}] \
+               [info patchlevel] [clock seconds]]
+
+
+#
+# Tables: narrow and wide rows, and BLOBs.
+#
+
+catch {dbi_dml -db $pool {drop table bench_narrow}}
+catch {dbi_dml -db $pool {drop table bench_wide}}
+catch {dbi_dml -db $pool {drop table bench_blob}}
+catch {dbi_dml -db $pool {drop table bench_tx}}
+
+dbi_dml -db $pool {
+    create table bench_narrow (a integer not null) engine=InnoDB
+}
+dbi_dml -db $pool {
+    create table bench_wide (
+        c0 integer, c1 integer, c2 integer, c3 integer,
+        c4 varchar(32), c5 varchar(32), c6 varchar(32), c7 varchar(32),
+        c8 double, c9 double, c10 datetime, c11 datetime,
+        c12 varchar(64), c13 varchar(64), c14 varchar(64), c15 varchar(64)
+    ) engine=InnoDB
+}
+dbi_dml -db $pool {
+    create table bench_blob (a integer not null, b longblob) engine=InnoDB
+}
+dbi_dml -db $pool {
+    create table bench_tx (a integer not null, b varchar(32)) engine=InnoDB
+}
+
+set rows 10000
+
+dbi_eval -db $pool -transaction committed {
+    for {set i 0} {$i < $rows} {incr i} {
+        dbi_dml {insert into bench_narrow (a) values (:i)}
+        dbi_dml {
+            insert into bench_wide values
+              (:i, :i, :i, :i,
+               'abcdefghijklmnopqrstuvwxyz', 'abcdefghijklmnopqrstuvwxyz',
+               'abcdefghijklmnopqrstuvwxyz', 'abcdefghijklmnopqrstuvwxyz',
+               3.14159, 2.71828, now(), now(),
+               repeat('x', 64), repeat('y', 64), repeat('z', 64), repeat('w', 64))
+        }
+    }
+}
+
+set blob [binary format a[expr {1024 * 1024}] ""]
+dbi_eval -db $pool -transaction committed {
+    for {set i 0} {$i < 8} {incr i} {
+        dbi_dml {insert into bench_blob (a, b) values (:i, :blob)}
+    }
+}
+
+
+#
+# Prepare: unique SQL each time so every query is prepared.
+#
+
+set n [iterations 5000]
+result prepare $n [elapsed {
+    dbi_eval -db $pool {
+        for {set i 0} {$i < $n} {incr i} {
+            dbi_rows "select $i"
+        }
+    }
+}] stmts/s
+
+
+#
+# Exec: the same prepared statement with a bind variable.
+#
+
+set n [iterations 20000]
+result exec $n [elapsed {
+    dbi_eval -db $pool {
+        for {set i 0} {$i < $n} {incr i} {
+            dbi_rows {select :i}
+        }
+    }
+}] execs/s
+
+
+#
+# Rows: a narrow one column result and a wide 16 column result.
+#
+
+set n [iterations 20]
+result rows-narrow [expr {$n * $rows}] [elapsed {
+    dbi_eval -db $pool {
+        for {set i 0} {$i < $n} {incr i} {
+            dbi_rows {select a from bench_narrow}
+        }
+    }
+}] rows/s
+
+set n [iterations 10]
+result rows-wide [expr {$n * $rows}] [elapsed {
+    dbi_eval -db $pool {
+        for {set i 0} {$i < $n} {incr i} {
+            dbi_rows {select * from bench_wide}
+        }
+    }
+}] rows/s
+
+
+#
+# JSON: the wide result serialized in Tcl and by the driver.
+#
+
+proc tojson {columns values} {
+    set n [llength $columns]
+    set objs {}
+    for {set i 0} {$i < [llength $values]} {incr i $n} {
+        set pairs {}
+        foreach c $columns v [lrange $values $i [expr {$i + $n - 1}]] {
+            lappend pairs "\"$c\":\"[string map {\" \\\" \\ \\\\} $v]\""
+        }
+        lappend objs "\{[join $pairs ,]\}"
+    }
+    return "\[[join $objs ,]\]"
+}
+
+set n [iterations 10]
+result json-tcl [expr {$n * $rows}] [elapsed {
+    dbi_eval -db $pool {
+        for {set i 0} {$i < $n} {incr i} {
+            set values [dbi_rows -columns cols {select * from bench_wide}]
+            tojson $cols $values
+        }
+    }
+}] rows/s
+
+result json-driver [expr {$n * $rows}] [elapsed {
+    dbi_eval -db $pool {
+        for {set i 0} {$i < $n} {incr i} {
+            dbi_1row {select /* dbimy:json */ * from bench_wide}
+        }
+    }
+}] rows/s
+
+
+#
+# BLOBs: 8 x 1MB per query.
+#
+
+set n [iterations 10]
+result blob [expr {$n * 8 * 1024 * 1024}] [elapsed {
+    dbi_eval -db $pool {
+        for {set i 0} {$i < $n} {incr i} {
+            dbi_rows {select b from bench_blob}
+        }
+    }
+}] bytes/s
+
+
+#
+# Transactions: one insert and commit each.
+#
+
+set n [iterations 2000]
+result commit $n [elapsed {
+    dbi_eval -db $pool {
+        for {set i 0} {$i < $n} {incr i} {
+            dbi_eval -transaction committed {
+                dbi_dml {insert into bench_tx (a, b) values (:i, 'x')}
+            }
+        }
+    }
+}] commits/s
+
+
+#
+# Background writes: autocommit inserts, then the same rows queued
+# for the writer. enqueue is the time the caller spends, insert-queue
+# includes waiting for them to be written.
+#
+
+set n [iterations 5000]
+result insert $n [elapsed {
+    dbi_eval -db $pool {
+        for {set i 0} {$i < $n} {incr i} {
+            dbi_dml {insert into bench_tx (a, b) values (:i, 'x')}
+        }
+    }
+}] inserts/s
+
+set enqueue 0
+result insert-queue $n [elapsed {
+    set enqueue [elapsed {
+        for {set i 0} {$i < $n} {incr i} {
+            dbimy enqueue -db $pool bench_tx [list a $i b x]
+        }
+    }]
+    dbimy writequeue -db $pool flush
+}] inserts/s
+result enqueue $n $enqueue inserts/s
+
+
+#
+# Scaling: as many threads as handles, each running short queries.
+#
+
+set n [iterations 5000]
+foreach handles {1 4 16} {
+    set pool bench$handles
+    set script [list apply {{pool n} {
+        for {set i 0} {$i < $n} {incr i} {
+            dbi_rows -db $pool {select a from bench_narrow where a = :i}
+        }
+    }} $pool $n]
+
+    set usec [elapsed {
+        set tids {}
+        for {set t 0} {$t < $handles} {incr t} {
+            lappend tids [ns_thread begin $script]
+        }
+        foreach tid $tids {
+            ns_thread wait $tid
+        }
+    }]
+    result scale-$handles [expr {$n * $handles}] $usec queries/s \
+        [list threads $handles]
+}
+set pool bench4
+
+
+catch {dbi_dml -db $pool {drop table bench_narrow}}
+catch {dbi_dml -db $pool {drop table bench_wide}}
+catch {dbi_dml -db $pool {drop table bench_blob}}
+catch {dbi_dml -db $pool {drop table bench_tx}}
+
+close $out
@@ -6,6 +6,21 @@
 set homedir   [pwd]
 set bindir    [file dirname [ns_info nsd]]
 
+#
+# The mysqld socket can be overridden, e.g. to use a server
+# started by tests/mysqld.sh.
+#
+
+set socket    [ns_env get -nocomplain DBIMY_SOCKET]
+if {$socket eq ""} {
+    set socket /var/lib/mysql/mysql.sock
+}
+
+set port      [ns_env get -nocomplain DBIMY_PORT]
+if {$port eq ""} {
+    set port 3306
+}
+
 
 
 #
@@ -47,6 +62,17 @@ ns_param   pool2           $homedir/nsdbimy.so
 ns_param   pool3           $homedir/nsdbimy.so
 ns_param   thread          $homedir/nsdbimy.so
 ns_param   embed           $homedir/nsdbimy.so
+ns_param   cache           $homedir/nsdbimy.so
+ns_param   admit           $homedir/nsdbimy.so
+ns_param   writer          $homedir/nsdbimy.so
+ns_param   compress        $homedir/nsdbimy.so
+ns_param   proxy           $homedir/nsdbimy.so
+ns_param   shard           $homedir/nsdbimy.so
+ns_param   shardhash       $homedir/nsdbimy.so
+ns_param   sharddown       $homedir/nsdbimy.so
+ns_param   bench1          $homedir/nsdbimy.so
+ns_param   bench4          $homedir/nsdbimy.so
+ns_param   bench16         $homedir/nsdbimy.so
 
 #
 # Database configuration.
@@ -64,27 +90,149 @@ ns_param   checkinterval   30
 ns_param   user            [ns_env get -nocomplain DBIMY_USER]
 ns_param   password        [ns_env get -nocomplain DBIMY_PASSWORD]
 ns_param   database        test
-ns_param   unixdomain      /var/lib/mysql/mysql.sock
+ns_param   unixdomain      $socket
 
 ns_section "ns/server/server1/module/pool2"
 ns_param   maxhandles      1
 ns_param   user            "invalid username"
-ns_param   unixdomain      /var/lib/mysql/mysql.sock
+ns_param   unixdomain      $socket
 
 ns_section "ns/server/server1/module/pool3"
 ns_param   maxhandles      1
 ns_param   database        "invalid database name"
-ns_param   unixdomain      /var/lib/mysql/mysql.sock
+ns_param   unixdomain      $socket
 
 ns_section "ns/server/server1/module/thread"
 ns_param   maxhandles      0  ;# Per-thread handles
 ns_param   user            [ns_env get -nocomplain DBIMY_USER]
 ns_param   password        [ns_env get -nocomplain DBIMY_PASSWORD]
 ns_param   database        test
-ns_param   unixdomain      /var/lib/mysql/mysql.sock
+ns_param   unixdomain      $socket
 
 ns_section "ns/server/server1/module/embed"
 ns_param   embed           yes
 ns_param   maxhandles      0
 ns_param   user            ""
 ns_param   database        "mysql"
+
+ns_section "ns/server/server1/module/cache"
+ns_param   maxhandles      2
+ns_param   user            [ns_env get -nocomplain DBIMY_USER]
+ns_param   password        [ns_env get -nocomplain DBIMY_PASSWORD]
+ns_param   database        test
+ns_param   unixdomain      $socket
+ns_param   cachesize       [expr {1024 * 1024}]
+ns_param   cachettl        60
+ns_param   cachetables     test
+
+ns_section "ns/server/server1/module/admit"
+ns_param   maxhandles      3
+ns_param   user            [ns_env get -nocomplain DBIMY_USER]
+ns_param   password        [ns_env get -nocomplain DBIMY_PASSWORD]
+ns_param   database        test
+ns_param   unixdomain      $socket
+ns_param   maxreads        1
+ns_param   maxwrites       1
+ns_param   admitwait       200
+
+ns_section "ns/server/server1/module/writer"
+ns_param   maxhandles      1
+ns_param   user            [ns_env get -nocomplain DBIMY_USER]
+ns_param   password        [ns_env get -nocomplain DBIMY_PASSWORD]
+ns_param   database        test
+ns_param   unixdomain      $socket
+ns_param   writequeue      100
+ns_param   writebatch      10
+ns_param   writeflush      50
+
+ns_section "ns/server/server1/module/compress"
+ns_param   maxhandles      1
+ns_param   user            [ns_env get -nocomplain DBIMY_USER]
+ns_param   password        [ns_env get -nocomplain DBIMY_PASSWORD]
+ns_param   database        test
+ns_param   host            127.0.0.1
+ns_param   port            $port
+ns_param   compress        on
+
+#
+# Connects through tests/faultproxy.tcl, which tests/fault.test
+# starts in front of the mysqld listening on 127.0.0.1:$port.
+#
+
+ns_section "ns/server/server1/module/proxy"
+ns_param   maxhandles      1
+ns_param   user            [ns_env get -nocomplain DBIMY_USER]
+ns_param   password        [ns_env get -nocomplain DBIMY_PASSWORD]
+ns_param   database        test
+ns_param   host            127.0.0.1
+ns_param   port            3399
+ns_param   connecttimeout  2
+ns_param   readtimeout     2
+ns_param   writetimeout    2
+
+#
+# Sharded pools. Every shard is the same server, so a scatter query
+# returns each row once per shard.
+#
+
+ns_section "ns/server/server1/module/shard"
+ns_param   maxhandles      1
+ns_param   user            [ns_env get -nocomplain DBIMY_USER]
+ns_param   password        [ns_env get -nocomplain DBIMY_PASSWORD]
+ns_param   database        test
+ns_param   shardkey        id
+ns_param   shardmap        range
+
+ns_section "ns/server/server1/module/shard/shards"
+ns_param   0               127.0.0.1:$port
+ns_param   100             "127.0.0.1:1 127.0.0.1:$port"
+
+ns_section "ns/server/server1/module/shardhash"
+ns_param   maxhandles      1
+ns_param   user            [ns_env get -nocomplain DBIMY_USER]
+ns_param   password        [ns_env get -nocomplain DBIMY_PASSWORD]
+ns_param   database        test
+ns_param   shardkey        id
+
+ns_section "ns/server/server1/module/shardhash/shards"
+foreach shard {a b c d} {
+    ns_param $shard        127.0.0.1:$port
+}
+
+#
+# The first shard can't be reached, and the shard key differs from
+# that of the other sharded pools.
+#
+
+ns_section "ns/server/server1/module/sharddown"
+ns_param   maxhandles      1
+ns_param   user            [ns_env get -nocomplain DBIMY_USER]
+ns_param   password        [ns_env get -nocomplain DBIMY_PASSWORD]
+ns_param   database        test
+ns_param   shardkey        sid
+ns_param   shardmap        range
+
+ns_section "ns/server/server1/module/sharddown/shards"
+ns_param   0               127.0.0.1:1
+ns_param   100             127.0.0.1:$port
+
+#
+# Pools for the benchmarks in tests/bench.tcl, which measure scaling
+# across maxhandles. Set DBIMY_EMBED=1 to use the embedded server.
+#
+
+set embed [ns_env get -nocomplain DBIMY_EMBED]
+if {$embed eq ""} {
+    set embed 0
+}
+
+foreach n {1 4 16} {
+    ns_section "ns/server/server1/module/bench$n"
+    ns_param   maxhandles      $n
+    ns_param   embed           $embed
+    ns_param   writequeue      100000
+    ns_param   user            [ns_env get -nocomplain DBIMY_USER]
+    ns_param   password        [ns_env get -nocomplain DBIMY_PASSWORD]
+    ns_param   database        test
+    ns_param   unixdomain      $socket
+}
@@ -0,0 +1,251 @@
+#
+# The contents of this file are subject to the Mozilla Public License
+# Version 1.1 (the "License"); you may not use this file except in
+# compliance with the License. You may obtain a copy of the License at
+# http://mozilla.org/
+#
+# Software distributed under the License is distributed on an "AS IS"
+# basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See
+# the License for the specific language governing rights and limitations
+# under the License.
+#
+# Copyright (C) 2006 Stephen Deasey <sdeasey@gmail.com>
+#
+# Alternatively, the contents of this file may be used under the terms
+# of the GNU General Public License (the "GPL"), in which case the
+# provisions of GPL are applicable instead of those above.  If you wish
+# to allow use of your version of this file only under the terms of the
+# GPL and not to allow others to use your version of this file under the
+# License, indicate your decision by deleting the provisions above and
+# replace them with the notice and other provisions required by the GPL.
+# If you do not delete the provisions above, a recipient may use your
+# version of this file under either the License or the GPL.
+#
+
+
+#
+# faultproxy.tcl --
+#
+#       A TCP proxy to put between the driver and mysqld which injects
+#       latency, limits bandwidth, drops connections part way through
+#       a result and stalls new connections before the handshake.
+#       Run it with tclsh:
+#
+#         tclsh faultproxy.tcl -listen port -control port -upstream host:port
+#
+#       Faults are set by sending one line commands to the control
+#       port, each of which is answered with one line:
+#
+#         latency ms        delay every chunk by ms each way
+#         bandwidth bytes   limit each direction to bytes per second, 0 off
+#         drop bytes        close the next connection to send more than
+#                           bytes more from the server, -1 off
+#         stall 0|1         hold new connections before connecting upstream
+#         reset             clear all faults
+#         stats             connections accepted, dropped and open
+#         exit              stop the proxy
+#
+
+
+array set opts {
+    -listen   3399
+    -control  3398
+    -upstream 127.0.0.1:3306
+}
+array set opts $argv
+
+lassign [split $opts(-upstream) :] upHost upPort
+
+proc reset {} {
+    global fault
+    array set fault {
+        latency   0
+        bandwidth 0
+        drop      -1
+        stall     0
+    }
+}
+reset
+
+array set stats {
+    accepted 0
+    dropped  0
+    open     0
+}
+set stalled {}
+
+
+#
+# Accept a client and connect it upstream, unless stalled.
+#
+
+proc accept {sock addr port} {
+    global fault stats stalled
+
+    incr stats(accepted)
+    incr stats(open)
+    fconfigure $sock -translation binary -blocking 0 -buffering none
+
+    if {$fault(stall)} {
+        lappend stalled $sock
+    } else {
+        connect $sock
+    }
+}
+
+proc connect {client} {
+    global upHost upPort conns
+
+    if {[catch {socket $upHost $upPort} server]} {
+        shut $client
+        return
+    }
+    fconfigure $server -translation binary -blocking 0 -buffering none
+
+    set conns($client) $server
+    set conns($server) $client
+    set conns($client,next) 0
+    set conns($server,next) 0
+
+    fileevent $client readable [list relay $client $server up]
+    fileevent $server readable [list relay $server $client down]
+}
+
+
+#
+# Read a chunk and schedule its delivery after latency and the time
+# it would take at the limited bandwidth. Chunks in one direction
+# are delivered in order.
+#
+
+proc relay {from to dir} {
+    global fault conns stats
+
+    if {[catch {read $from 16384} data] || ([eof $from] && $data eq "")} {
+        shut $from
+        return
+    }
+    if {$data eq ""} {
+        return
+    }
+
+    set drop 0
+    if {$dir eq "down" && $fault(drop) >= 0} {
+        if {[string length $data] > $fault(drop)} {
+            set data [string range $data 0 [expr {$fault(drop) - 1}]]
+            set fault(drop) -1
+            set drop 1
+        } else {
+            set fault(drop) [expr {$fault(drop) - [string length $data]}]
+        }
+    }
+
+    set now [clock milliseconds]
+    set at  [expr {max($now + $fault(latency), $conns($from,next))}]
+    if {$fault(bandwidth) > 0} {
+        incr at [expr {[string length $data] * 1000 / $fault(bandwidth)}]
+    }
+    set conns($from,next) $at
+
+    if {$drop} {
+        fileevent $from readable {}
+        after [expr {$at - $now}] [list deliver $to $data $from]
+    } else {
+        after [expr {$at - $now}] [list deliver $to $data]
+    }
+}
+
+proc deliver {sock data {drop ""}} {
+    global stats
+
+    if {[catch {puts -nonewline $sock $data}]} {
+        shut $sock
+        return
+    }
+    if {$drop ne ""} {
+        incr stats(dropped)
+        shut $drop
+    }
+}
+
+proc shut {sock} {
+    global conns stats
+
+    if {$sock ni [chan names]} {
+        return
+    }
+    set socks [list $sock]
+    if {[info exists conns($sock)]} {
+        lappend socks $conns($sock)
+    }
+    foreach s $socks {
+        if {[info exists conns($s)]} {
+            unset conns($s) conns($s,next)
+        }
+        catch {close $s}
+    }
+    incr stats(open) -1
+}
+
+
+#
+# Control connection.
+#
+
+proc control {sock addr port} {
+    fconfigure $sock -buffering line -blocking 0
+    fileevent $sock readable [list command $sock]
+}
+
+proc command {sock} {
+    global fault stats stalled
+
+    if {[catch {gets $sock line} n] || $n < 0} {
+        if {[eof $sock]} {
+            close $sock
+        }
+        return
+    }
+    lassign $line cmd arg
+    switch -- $cmd {
+        latency - bandwidth - drop {
+            set fault($cmd) $arg
+            set reply ok
+        }
+        stall {
+            set fault(stall) $arg
+            if {!$arg} {
+                foreach client $stalled {
+                    connect $client
+                }
+                set stalled {}
+            }
+            set reply ok
+        }
+        reset {
+            reset
+            foreach client $stalled {
+                connect $client
+            }
+            set stalled {}
+            set reply ok
+        }
+        stats {
+            set reply [array get stats]
+        }
+        exit {
+            puts $sock ok
+            exit 0
+        }
+        default {
+            set reply "error: unknown command: $cmd"
+        }
+    }
+    puts $sock $reply
+}
+
+
+socket -server accept -myaddr 127.0.0.1 $opts(-listen)
+socket -server control -myaddr 127.0.0.1 $opts(-control)
+
+vwait forever
@@ -0,0 +1,53 @@
+#!/bin/sh
+#
+# mysqld.sh --
+#
+#       Start or stop a throwaway mysqld for the tests and benchmarks,
+#       with its data directory and socket under tests/mysqld. It
+#       also listens on 127.0.0.1 port $DBIMY_PORT, 3307 by default,
+#       for the compression and fault tests. Point the tests at it with:
+#
+#         DBIMY_SOCKET=`pwd`/tests/mysqld/mysql.sock DBIMY_PORT=3307 make test
+#
+#       Usage: tests/mysqld.sh start|stop
+#
+
+MYSQLD=${MYSQLD:-mysqld}
+DIR=`pwd`/tests/mysqld
+PORT=${DBIMY_PORT:-3307}
+
+case "$1" in
+start)
+    if [ ! -d "$DIR/data" ]; then
+        mkdir -p "$DIR"
+        $MYSQLD --no-defaults --initialize-insecure \
+            --datadir="$DIR/data" > "$DIR/init.log" 2>&1 || {
+            cat "$DIR/init.log"
+            exit 1
+        }
+    fi
+    $MYSQLD --no-defaults --datadir="$DIR/data" \
+        --socket="$DIR/mysql.sock" --pid-file="$DIR/mysqld.pid" \
+        --port=$PORT --bind-address=127.0.0.1 --log-error="$DIR/error.log" &
+    i=0
+    while [ ! -S "$DIR/mysql.sock" ]; do
+        i=`expr $i + 1`
+        if [ $i -gt 60 ]; then
+            echo "mysqld did not start, see $DIR/error.log"
+            exit 1
+        fi
+        sleep 1
+    done
+    mysql --no-defaults --socket="$DIR/mysql.sock" -u root \
+        -e "create database if not exists test"
+    ;;
+stop)
+    if [ -f "$DIR/mysqld.pid" ]; then
+        kill `cat "$DIR/mysqld.pid"`
+    fi
+    ;;
+*)
+    echo "usage: $0 start|stop"
+    exit 1
+    ;;
+esac
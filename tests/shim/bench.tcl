@@ -0,0 +1,92 @@
+#
+# The contents of this file are subject to the Mozilla Public License
+# Version 1.1 (the "License"); you may not use this file except in
+# compliance with the License. You may obtain a copy of the License at
+# http://mozilla.org/
+#
+# Software distributed under the License is distributed on an "AS IS"
+# basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See
+# the License for the specific language governing rights and limitations
+# under the License.
+#
+# Copyright (C) 2006 Stephen Deasey <sdeasey@gmail.com>
+#
+# Alternatively, the contents of this file may be used under the terms
+# of the GNU General Public License (the "GPL"), in which case the
+# provisions of GPL are applicable instead of those above.  If you wish
+# to allow use of your version of this file only under the terms of the
+# GPL and not to allow others to use your version of this file under the
+# License, indicate your decision by deleting the provisions above and
+# replace them with the notice and other provisions required by the GPL.
+# If you do not delete the provisions above, a recipient may use your
+# version of this file under either the License or the GPL.
+#
+
+
+#
+# bench.tcl --
+#
+#       Measure the CPU cost of the driver callbacks per row, with
+#       nsdbimy linked against the fake client library in
+#       tests/shim/fakemysql.c. Run it with "make bench-shim".
+#
+#       Results are written one JSON object per line to the file
+#       named by DBIMY_BENCH_OUTPUT, default bench_output.txt.
+#
+
+
+set output [ns_env get -nocomplain DBIMY_BENCH_OUTPUT]
+if {$output eq ""} {
+    set output bench_output.txt
+}
+set out [open $output a]
+
+
+#
+# Run a query n times against the given synthetic result and report
+# nanoseconds and driver allocations per row and per query.
+#
+
+proc shim {name n sql args} {
+    global out
+
+    dbimy_shim config {*}$args
+    dbi_rows $sql ;# Prepare outside the timed loop.
+    dbimy_shim reset
+
+    set start [clock microseconds]
+    dbi_eval {
+        for {set i 0} {$i < $n} {incr i} {
+            dbi_rows $sql
+        }
+    }
+    set usec [expr {[clock microseconds] - $start}]
+
+    set stats [dbimy_shim stats]
+    set rows  [expr {max(1, [dict get $stats rows])}]
+
+    set json [format {{"name":"%s","queries":%d,"rows":%d,"ns_per_row":%.1f,"ns_per_query":%.1f,"allocs_per_row":%.3f,"allocs_per_query":%.3f,"config":"%s"}} \
+                  $name $n $rows \
+                  [expr {$usec * 1000.0 / $rows}] \
+                  [expr {$usec * 1000.0 / $n}] \
+                  [expr {[dict get $stats allocs] / double($rows)}] \
+                  [expr {[dict get $stats allocs] / double($n)}] \
+                  $args]
+    puts $out $json
+    flush $out
+    ns_log notice "bench-shim: $json"
+}
+
+#
+# The shim fixes the columns of a statement when it is prepared and
+# nsdbi caches prepared statements by SQL, so each case needs its own.
+#
+
+shim single     100000 {select c0}                              -rows 1     -cols 1  -width 8
+shim narrow     100    {select c0 from narrow}                  -rows 10000 -cols 1  -width 8
+shim wide       100    {select * from wide}                     -rows 10000 -cols 16 -width 32
+shim large      100    {select c0, c1, c2, c3 from large}       -rows 1000  -cols 4  -width 4096
+shim blob       100    {select c0, c1, c2, c3 from blob}        -rows 1000  -cols 4  -width 4096 -blob 1
+shim cacheable  1000   {select /* dbimy:cache */ * from cached} -rows 100   -cols 4  -width 16
+
+close $out
@@ -0,0 +1,28 @@
+#
+# nsdbimy configuration for the fake client library benchmark.
+#
+
+
+set homedir   [pwd]
+set bindir    [file dirname [ns_info nsd]]
+
+
+ns_section "ns/parameters"
+ns_param   home           $homedir
+ns_param   tcllibrary     $bindir/../tcl
+ns_param   logdebug       false
+
+ns_section "ns/servers"
+ns_param   server1         "Server One"
+
+ns_section "ns/server/server1/tcl"
+ns_param   initfile        ${bindir}/init.tcl
+
+ns_section "ns/server/server1/modules"
+ns_param   shim            $homedir/nsdbimy-shim.so
+
+ns_section "ns/server/server1/module/shim"
+ns_param   default         true
+ns_param   maxhandles      1
+ns_param   maxqueries      0
+ns_param   cachesize       [expr {1024 * 1024}]
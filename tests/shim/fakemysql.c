@@ -0,0 +1,502 @@
+/*
+ * The contents of this file are subject to the Mozilla Public License
+ * Version 1.1 (the "License"); you may not use this file except in
+ * compliance with the License. You may obtain a copy of the License at
+ * http://mozilla.org/.
+ *
+ * Software distributed under the License is distributed on an "AS IS"
+ * basis, WITHOUT WARRANTY OF ANY KIND, either express or implied. See
+ * the License for the specific language governing rights and limitations
+ * under the License.
+ *
+ * Copyright (C) 2006 Stephen Deasey <sdeasey@gmail.com>
+ *
+ * Alternatively, the contents of this file may be used under the terms
+ * of the GNU General Public License (the "GPL"), in which case the
+ * provisions of GPL are applicable instead of those above.  If you wish
+ * to allow use of your version of this file only under the terms of the
+ * GPL and not to allow others to use your version of this file under the
+ * License, indicate your decision by deleting the provisions above and
+ * replace them with the notice and other provisions required by the GPL.
+ * If you do not delete the provisions above, a recipient may use your
+ * version of this file under either the License or the GPL.
+ */
+
+/*
+ * fakemysql.c --
+ *
+ *      A scripted, in-process stand-in for the parts of the
+ *      libmysqlclient API used by nsdbimy. Queries which start with
+ *      "select" return synthetic rows straight from memory, anything
+ *      else succeeds with no result. Linking the driver against this
+ *      instead of the real client library isolates the CPU cost of
+ *      the driver itself.
+ *
+ *      The driver is linked with --wrap for the ns_malloc family so
+ *      that allocations made by nsdbimy.c can be counted.
+ *
+ *      Counters are not thread safe: run the harness single threaded.
+ */
+
+#include "nsdbidrv.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <mysql/mysql.h>
+#include <mysql/errmsg.h>
+
+#define SHIM_MAX_COLS 256
+
+
+/*
+ * The following structures stand in for the opaque client library
+ * statement and result set types.
+ */
+
+typedef struct FakeStmt {
+    MYSQL         *conn;
+    unsigned long  numParams;
+    unsigned int   numCols;
+    long           row;          /* Current row, -1 before first. */
+    int            executed;
+    MYSQL_BIND    *result;       /* Bound by mysql_stmt_bind_result. */
+    MYSQL_FIELD   *fields;
+} FakeStmt;
+
+typedef struct FakeRes {
+    MYSQL_FIELD   *fields;
+} FakeRes;
+
+
+/*
+ * The following describe the synthetic result and count calls.
+ */
+
+static struct {
+    long          rows;
+    unsigned int  cols;
+    unsigned long width;
+    int           blob;
+} script = { 100, 4, 16, 0 };
+
+static struct {
+    Tcl_WideInt   prepares;
+    Tcl_WideInt   executes;
+    Tcl_WideInt   queries;       /* Plain text queries... */
+    Tcl_WideInt   queryBytes;    /* ...and their length. */
+    Tcl_WideInt   fetches;
+    Tcl_WideInt   fetchColumns;
+    Tcl_WideInt   rows;
+    Tcl_WideInt   bytes;
+    Tcl_WideInt   allocs;
+} counts;
+
+static char value[64 * 1024];    /* Synthetic column data. */
+
+static char *colNames[SHIM_MAX_COLS];
+
+extern void *__real_ns_malloc(size_t size);
+extern void *__real_ns_calloc(size_t num, size_t size);
+extern void *__real_ns_realloc(void *ptr, size_t size);
+extern char *__real_ns_strdup(CONST char *str);
+
+Tcl_ObjCmdProc DbiMyShimObjCmd;
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * __wrap_ns_malloc, etc. --
+ *
+ *      Count allocations made by the driver.
+ *
+ *----------------------------------------------------------------------
+ */
+
+void *
+__wrap_ns_malloc(size_t size)
+{
+    counts.allocs++;
+    return __real_ns_malloc(size);
+}
+
+void *
+__wrap_ns_calloc(size_t num, size_t size)
+{
+    counts.allocs++;
+    return __real_ns_calloc(num, size);
+}
+
+void *
+__wrap_ns_realloc(void *ptr, size_t size)
+{
+    counts.allocs++;
+    return __real_ns_realloc(ptr, size);
+}
+
+char *
+__wrap_ns_strdup(CONST char *str)
+{
+    counts.allocs++;
+    return __real_ns_strdup(str);
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Library, thread and connection functions.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+mysql_server_init(int argc, char **argv, char **groups)
+{
+    int i;
+
+    memset(value, 'x', sizeof(value));
+    for (i = 0; i < SHIM_MAX_COLS; i++) {
+        colNames[i] = malloc(16);
+        sprintf(colNames[i], "c%d", i);
+    }
+    return 0;
+}
+
+void mysql_server_end(void) {}
+unsigned int mysql_thread_safe(void) { return 1; }
+my_bool mysql_thread_init(void) { return 0; }
+void mysql_thread_end(void) {}
+my_bool mysql_embedded(void) { return 0; }
+
+MYSQL *
+mysql_init(MYSQL *conn)
+{
+    if (conn == NULL) {
+        conn = calloc(1, sizeof(MYSQL));
+    }
+    conn->net.fd = -1;
+    return conn;
+}
+
+int
+mysql_options(MYSQL *conn, enum mysql_option option, const void *arg)
+{
+    return 0;
+}
+
+MYSQL *
+mysql_real_connect(MYSQL *conn, const char *host, const char *user,
+                   const char *passwd, const char *db, unsigned int port,
+                   const char *unix_socket, unsigned long flags)
+{
+    return conn;
+}
+
+void mysql_close(MYSQL *conn) { free(conn); }
+int mysql_ping(MYSQL *conn) { return 0; }
+int mysql_query(MYSQL *conn, const char *sql) { return 0; }
+my_bool mysql_autocommit(MYSQL *conn, my_bool mode) { return 0; }
+my_bool mysql_commit(MYSQL *conn) { return 0; }
+my_bool mysql_rollback(MYSQL *conn) { return 0; }
+unsigned int mysql_errno(MYSQL *conn) { return 0; }
+const char *mysql_error(MYSQL *conn) { return ""; }
+const char *mysql_sqlstate(MYSQL *conn) { return "00000"; }
+const char *mysql_get_server_info(MYSQL *conn) { return "fakemysql"; }
+const char *mysql_get_host_info(MYSQL *conn) { return "shim"; }
+unsigned int mysql_warning_count(MYSQL *conn) { return 0; }
+
+int
+mysql_real_query(MYSQL *conn, const char *sql, unsigned long length)
+{
+    counts.queries++;
+    counts.queryBytes += (Tcl_WideInt) length;
+    return 0;
+}
+
+unsigned long
+mysql_real_escape_string(MYSQL *conn, char *to, const char *from,
+                         unsigned long length)
+{
+    unsigned long n = 0;
+
+    while (length-- > 0) {
+        if (*from == '\\' || *from == '\'') {
+            to[n++] = '\\';
+        }
+        to[n++] = *from++;
+    }
+    to[n] = '\0';
+
+    return n;
+}
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * Prepared statement functions.
+ *
+ *----------------------------------------------------------------------
+ */
+
+MYSQL_STMT *
+mysql_stmt_init(MYSQL *conn)
+{
+    FakeStmt *fs = calloc(1, sizeof(FakeStmt));
+
+    fs->conn = conn;
+    return (MYSQL_STMT *) fs;
+}
+
+int
+mysql_stmt_prepare(MYSQL_STMT *st, const char *sql, unsigned long length)
+{
+    FakeStmt     *fs = (FakeStmt *) st;
+    unsigned long i;
+
+    counts.prepares++;
+
+    for (i = 0; i < length; i++) {
+        if (sql[i] == '?') {
+            fs->numParams++;
+        }
+    }
+    while (length > 0 && isspace(UCHAR(*sql))) {
+        sql++;
+        length--;
+    }
+    if (length >= 6 && strncasecmp(sql, "select", 6) == 0) {
+        fs->numCols = script.cols;
+        fs->fields = calloc(fs->numCols, sizeof(MYSQL_FIELD));
+        for (i = 0; i < fs->numCols; i++) {
+            fs->fields[i].name = colNames[i];
+            fs->fields[i].type = script.blob
+                ? MYSQL_TYPE_BLOB : MYSQL_TYPE_VAR_STRING;
+            fs->fields[i].length = script.width;
+        }
+    }
+    return 0;
+}
+
+my_bool
+mysql_stmt_close(MYSQL_STMT *st)
+{
+    FakeStmt *fs = (FakeStmt *) st;
+
+    free(fs->fields);
+    free(fs);
+    return 0;
+}
+
+unsigned long mysql_stmt_param_count(MYSQL_STMT *st) {
+    return ((FakeStmt *) st)->numParams;
+}
+unsigned int mysql_stmt_field_count(MYSQL_STMT *st) {
+    return ((FakeStmt *) st)->numCols;
+}
+
+MYSQL_RES *
+mysql_stmt_result_metadata(MYSQL_STMT *st)
+{
+    FakeRes *res = calloc(1, sizeof(FakeRes));
+
+    res->fields = ((FakeStmt *) st)->fields;
+    return (MYSQL_RES *) res;
+}
+
+MYSQL_FIELD *
+mysql_fetch_field_direct(MYSQL_RES *res, unsigned int index)
+{
+    return ((FakeRes *) res)->fields + index;
+}
+
+void mysql_free_result(MYSQL_RES *res) { free(res); }
+
+my_bool mysql_stmt_bind_param(MYSQL_STMT *st, MYSQL_BIND *bind) { return 0; }
+
+my_bool
+mysql_stmt_bind_result(MYSQL_STMT *st, MYSQL_BIND *bind)
+{
+    ((FakeStmt *) st)->result = bind;
+    return 0;
+}
+
+int
+mysql_stmt_execute(MYSQL_STMT *st)
+{
+    FakeStmt *fs = (FakeStmt *) st;
+
+    counts.executes++;
+    fs->executed = 1;
+    fs->row = -1;
+    return 0;
+}
+
+int mysql_stmt_store_result(MYSQL_STMT *st) { return 0; }
+
+int
+mysql_stmt_fetch(MYSQL_STMT *st)
+{
+    FakeStmt     *fs = (FakeStmt *) st;
+    unsigned int  i;
+
+    counts.fetches++;
+
+    if (fs->numCols == 0 || ++fs->row >= script.rows) {
+        return MYSQL_NO_DATA;
+    }
+    for (i = 0; i < fs->numCols; i++) {
+        *fs->result[i].length  = script.width;
+        *fs->result[i].is_null = 0;
+    }
+    counts.rows++;
+    return 0;
+}
+
+int
+mysql_stmt_fetch_column(MYSQL_STMT *st, MYSQL_BIND *bind,
+                        unsigned int column, unsigned long offset)
+{
+    unsigned long length = script.width;
+
+    counts.fetchColumns++;
+
+    if (length > bind->buffer_length) {
+        length = bind->buffer_length;
+    }
+    memcpy(bind->buffer, value, length);
+    if (bind->length != NULL) {
+        *bind->length = script.width;
+    }
+    counts.bytes += length;
+    return 0;
+}
+
+my_bool
+mysql_stmt_free_result(MYSQL_STMT *st)
+{
+    ((FakeStmt *) st)->row = script.rows;
+    return 0;
+}
+
+int mysql_stmt_next_result(MYSQL_STMT *st) { return -1; }
+unsigned int mysql_stmt_errno(MYSQL_STMT *st) { return 0; }
+const char *mysql_stmt_error(MYSQL_STMT *st) { return ""; }
+const char *mysql_stmt_sqlstate(MYSQL_STMT *st) { return "00000"; }
+my_ulonglong mysql_stmt_affected_rows(MYSQL_STMT *st) { return 0; }
+my_ulonglong mysql_stmt_insert_id(MYSQL_STMT *st) { return 0; }
+
+
+/*
+ *----------------------------------------------------------------------
+ *
+ * DbiMyShimObjCmd --
+ *
+ *      Implements dbimy_shim, created by the driver when built with
+ *      DBIMY_SHIM:
+ *
+ *          dbimy_shim config ?-rows n? ?-cols n? ?-width n? ?-blob bool?
+ *          dbimy_shim stats
+ *          dbimy_shim reset
+ *
+ * Results:
+ *      Standard Tcl result.
+ *
+ * Side effects:
+ *      Changes the synthetic result of later queries.
+ *
+ *----------------------------------------------------------------------
+ */
+
+int
+DbiMyShimObjCmd(ClientData arg, Tcl_Interp *interp,
+                int objc, Tcl_Obj *CONST objv[])
+{
+    Tcl_Obj  *resObj;
+    int       opt, i, n;
+    long      l;
+
+    static CONST char *opts[] = {
+        "config", "reset", "stats", NULL
+    };
+    enum IOptIdx {
+        IConfigIdx, IResetIdx, IStatsIdx
+    };
+    static CONST char *flags[] = {
+        "-rows", "-cols", "-width", "-blob", NULL
+    };
+    enum IFlagIdx {
+        IRowsIdx, IColsIdx, IWidthIdx, IBlobIdx
+    };
+
+    if (objc < 2) {
+        Tcl_WrongNumArgs(interp, 1, objv, "config|reset|stats ?args?");
+        return TCL_ERROR;
+    }
+    if (Tcl_GetIndexFromObj(interp, objv[1], opts, "option", 0,
+                            &opt) != TCL_OK) {
+        return TCL_ERROR;
+    }
+
+    switch (opt) {
+    case IConfigIdx:
+        if (objc % 2 != 0) {
+            Tcl_WrongNumArgs(interp, 2, objv, "?-flag value ...?");
+            return TCL_ERROR;
+        }
+        for (i = 2; i < objc; i += 2) {
+            if (Tcl_GetIndexFromObj(interp, objv[i], flags, "flag", 0,
+                                    &n) != TCL_OK
+                    || Tcl_GetLongFromObj(interp, objv[i+1], &l) != TCL_OK) {
+                return TCL_ERROR;
+            }
+            switch (n) {
+            case IRowsIdx:
+                script.rows = l;
+                break;
+            case IColsIdx:
+                if (l < 1 || l > SHIM_MAX_COLS || l > DBI_MAX_BIND) {
+                    Tcl_SetResult(interp, "invalid column count", TCL_STATIC);
+                    return TCL_ERROR;
+                }
+                script.cols = (unsigned int) l;
+                break;
+            case IWidthIdx:
+                if (l < 0 || l > (long) sizeof(value)) {
+                    Tcl_SetResult(interp, "invalid width", TCL_STATIC);
+                    return TCL_ERROR;
+                }
+                script.width = (unsigned long) l;
+                break;
+            case IBlobIdx:
+                script.blob = l != 0;
+                break;
+            }
+        }
+        break;
+
+    case IResetIdx:
+        memset(&counts, 0, sizeof(counts));
+        break;
+
+    case IStatsIdx:
+        resObj = Tcl_NewListObj(0, NULL);
+#define ShimStat(name, field)                                             \
+        Tcl_ListObjAppendElement(interp, resObj, Tcl_NewStringObj(name, -1)); \
+        Tcl_ListObjAppendElement(interp, resObj, Tcl_NewWideIntObj(counts.field))
+        ShimStat("prepares",     prepares);
+        ShimStat("executes",     executes);
+        ShimStat("queries",      queries);
+        ShimStat("querybytes",   queryBytes);
+        ShimStat("fetches",      fetches);
+        ShimStat("fetchcolumns", fetchColumns);
+        ShimStat("rows",         rows);
+        ShimStat("bytes",        bytes);
+        ShimStat("allocs",       allocs);
+#undef ShimStat
+        Tcl_SetObjResult(interp, resObj);
+        break;
+    }
+
+    return TCL_OK;
+}